@@ -7,109 +7,1343 @@
 
 #include <dataflash.h>
 
-uint16_t FlashStoreManager::ReadStoresFromFlash(void)
+template <class FlashType>
+uint16_t FlashStoreManagerT<FlashType>::ReadStoresFromFlash(void)
 {
-    storeList.Flush();
+    FLASH_STAT(uint32_t startUs = micros());
     
-    //read the FAT
-    uint16_t maxStores = flash->bytesPerBlock / 8;
-    for(uint16_t index = 0; index < maxStores; index++)
+    storeCount = 0;
+    currStore = NULL;
+    memset(slotIndex, NO_STORE, sizeof(slotIndex));
+
+#if FLASH_WEAR_LEVELING
+    LoadWear();
+    relocating = 0xffff;
+#endif
+    
+#if FLASH_FAT_JOURNAL
+    ReplayJournal();
+#else
+    ReadFAT();
+#endif
+    
+    //find where each store left off
+    for(uint16_t i = 0; i < storeCount; i++)
+    {
+        if(stores[i].ring) RecoverRing(stores[i]);
+        else stores[i].currAddress = RecoverCursor(stores[i]);
+    }
+    
+    //carry on placing stores after the last one
+    allocCursor = storeCount ? stores[byAddress[storeCount - 1]].endAddress : MetadataSize();
+    
+    FLASH_STAT(mountLatency.Add(micros() - startUs));
+    
+    return storeCount;
+}
+
+template <class FlashType>
+uint16_t FlashStoreManagerT<FlashType>::LowerBound(uint32_t address)
+{
+    uint16_t lo = 0;
+    uint16_t hi = storeCount;
+    while(lo < hi)
+    {
+        uint16_t mid = (lo + hi) / 2;
+        if(stores[byAddress[mid]].startAddress < address) lo = mid + 1;
+        else hi = mid;
+    }
+    
+    return lo;
+}
+
+/*
+ * returns the start of the first unallocated region at or after address, and its length
+ * (0 if there's nothing left)
+ */
+template <class FlashType>
+uint32_t FlashStoreManagerT<FlashType>::NextFreeRegion(uint32_t address, uint32_t& length)
+{
+    if(address < MetadataSize()) address = MetadataSize(); //reserved for the journal or FAT
+    
+    uint16_t pos = LowerBound(address);
+    
+    //might be inside the store before...
+    if(pos && stores[byAddress[pos - 1]].endAddress > address) address = stores[byAddress[pos - 1]].endAddress;
+    
+    //...or up against the ones after
+    while(pos < storeCount && stores[byAddress[pos]].startAddress <= address)
+    {
+        if(stores[byAddress[pos]].endAddress > address) address = stores[byAddress[pos]].endAddress;
+        pos++;
+    }
+    
+    uint32_t end = pos < storeCount ? stores[byAddress[pos]].startAddress : flash->GetByteCount();
+
+#if FLASH_WEAR_LEVELING
+    //a ring's new home is taken from the start of its move, though it only gets an entry at the switch
+    if(relocating != 0xffff && relocateTarget < end && relocateEnd > address)
+    {
+        if(relocateTarget <= address) return NextFreeRegion(relocateEnd, length);
+        end = relocateTarget;
+    }
+#endif
+
+    length = end > address ? end - address : 0;
+    
+    return address;
+}
+
+/*
+ * Picks a block-aligned spot for size bytes from the free extents (the gaps between stores,
+ * adjacent holes already merged). Returns 0 if nothing fits; the metadata blocks are never free.
+ */
+template <class FlashType>
+uint32_t FlashStoreManagerT<FlashType>::Allocate(uint32_t size)
+{
+    uint32_t best = 0;
+    uint32_t bestFit = 0;
+    uint32_t bestDistance = 0;
+    
+    uint32_t length = 0;
+    for(uint32_t addr = NextFreeRegion(0, length); length; addr = NextFreeRegion(addr + length, length))
+    {
+#if FLASH_WEAR_LEVELING
+        //every block-aligned start in the hole, scored by the erases of the blocks it would cover
+        if(allocPolicy == ALLOC_LEAST_WORN)
+        {
+            if(length < size) continue;
+            
+            uint32_t wearSum = WearOf(addr, size);
+            for(uint32_t start = addr; ; start += flash->GetBlockSize())
+            {
+                uint32_t distance = start - allocCursor;
+                if(!best || wearSum < bestFit || (wearSum == bestFit && distance < bestDistance))
+                {
+                    best = start;
+                    bestFit = wearSum;
+                    bestDistance = distance;
+                }
+                
+                if(start + size >= addr + length) break;
+                wearSum += Wear(start + size) - Wear(start);
+            }
+            
+            continue;
+        }
+#endif
+
+        //next fit can also start part way into the hole the cursor is in
+        uint32_t starts[2] = {addr, allocCursor};
+        for(uint8_t c = 0; c < (allocPolicy == ALLOC_NEXT_FIT ? 2 : 1); c++)
+        {
+            uint32_t start = starts[c];
+            if(start < addr || start >= addr + length) continue;
+            if(addr + length - start < size) continue;
+            
+            uint32_t fit = allocPolicy == ALLOC_BEST_FIT ? length : 0;
+            uint32_t distance = start - allocCursor; //wraps, so holes behind the cursor come last
+            
+            if(!best || fit < bestFit || (fit == bestFit && distance < bestDistance))
+            {
+                best = start;
+                bestFit = fit;
+                bestDistance = distance;
+            }
+        }
+    }
+    
+    if(best) allocCursor = best + size;
+    
+    return best;
+}
+
+template <class FlashType>
+uint32_t FlashStoreManagerT<FlashType>::GetFreeSpace(uint32_t* largest, uint16_t* extents)
+{
+    uint32_t total = 0;
+    uint32_t biggest = 0;
+    uint16_t count = 0;
+    
+    uint32_t length = 0;
+    for(uint32_t addr = NextFreeRegion(0, length); length; addr = NextFreeRegion(addr + length, length))
+    {
+        total += length;
+        if(length > biggest) biggest = length;
+        count++;
+    }
+    
+    if(largest) *largest = biggest;
+    if(extents) *extents = count;
+    
+    return total;
+}
+
+template <class FlashType>
+Datastore* FlashStoreManagerT<FlashType>::AddStore(const Datastore& store)
+{
+    if(storeCount == FLASH_MAX_STORES || store.storeNumber >= FLASH_FAT_SLOTS) return NULL;
+    
+    //keep the address view sorted
+    uint16_t pos = LowerBound(store.startAddress);
+    memmove(&byAddress[pos + 1], &byAddress[pos], (storeCount - pos) * sizeof(StoreIndex));
+    
+    StoreIndex index = storeCount++;
+    stores[index] = store;
+    slotIndex[store.storeNumber] = index;
+    byAddress[pos] = index;
+    
+    return &stores[index];
+}
+
+template <class FlashType>
+void FlashStoreManagerT<FlashType>::RemoveStore(Datastore* store)
+{
+    StoreIndex index = store - stores;
+    
+    uint16_t pos = LowerBound(store->startAddress);
+    memmove(&byAddress[pos], &byAddress[pos + 1], (storeCount - 1 - pos) * sizeof(StoreIndex));
+    slotIndex[store->storeNumber] = NO_STORE;
+    
+    if(currStore == store) currStore = NULL;
+    
+    //fill the hole with the last entry so the table stays dense
+    StoreIndex last = --storeCount;
+    if(index != last)
+    {
+        stores[index] = stores[last];
+        slotIndex[stores[index].storeNumber] = index;
+        
+        uint16_t lastPos = LowerBound(stores[index].startAddress);
+        byAddress[lastPos] = index;
+        
+        if(currStore == &stores[last]) currStore = &stores[index];
+    }
+}
+
+/*
+ * The original table: an 8-byte slot per store number in block 0, read in one transaction. With the
+ * journal on, this is how a device written without it is recognized.
+ */
+template <class FlashType>
+void FlashStoreManagerT<FlashType>::ReadFAT(void)
+{
+    //read the whole FAT in one transaction, a few entries at a time
+    uint16_t maxStores = flash->GetBlockSize() / 8;
+    if(!flash->BeginRead(0, flash->GetBlockSize())) return;
+    
+    uint32_t entries[16]; //8 FAT entries: start, end, start, end...
+    for(uint16_t index = 0; index < maxStores; index += 8)
     {
-        //get start address
-        BufferArray fileInfo(8);
-        flash->ReadBytes(index * 8, &fileInfo[0], fileInfo.GetSize());
+        flash->ReceiveBytes((uint8_t*)entries, sizeof(entries));
         
-        uint32_t start = -1;
-        memcpy(&fileInfo[0], &start, 4);
+        for(uint8_t i = 0; i < 8; i++)
+        {
+            uint32_t start = entries[2 * i];
+            uint32_t end = entries[2 * i + 1];
+            
+            if(start == 0xffffffff) continue;
+            if(start % flash->GetBlockSize() || start >= (end & ~FAT_RING) || (end & ~FAT_RING) > flash->GetByteCount()) continue; //not a FAT entry
+            
+            //past FLASH_FAT_SLOTS or FLASH_MAX_STORES: it stays on the chip, unlisted
+            if(!AddStore(Datastore(index + i, start, end & ~FAT_RING, end & FAT_RING))) SerialUSB.println("No room for store.");
+        }
+    }
+    
+    flash->EndRead();
+}
+
+#if FLASH_FAT_JOURNAL
+template <class FlashType>
+bool FlashStoreManagerT<FlashType>::ReadJournalHeader(uint32_t address, uint16_t& seq)
+{
+    JournalRecord header;
+    if(flash->ReadBytes(address, (uint8_t*)&header, sizeof(header)) != sizeof(header)) return false;
+    if(header.storeNumber != JOURNAL_HEADER || !header.IsValid()) return false;
+    
+    seq = header.startBlock;
+    return true;
+}
+
+/*
+ * Picks the active journal block and applies its records in order, reading the block in one transaction.
+ */
+template <class FlashType>
+void FlashStoreManagerT<FlashType>::ReplayJournal(void)
+{
+    uint32_t block = flash->GetBlockSize();
+    uint16_t slots = block / sizeof(JournalRecord);
+    
+    uint16_t seq0 = 0;
+    uint16_t seq1 = 0;
+    bool valid0 = ReadJournalHeader(0, seq0);
+    bool valid1 = ReadJournalHeader(block, seq1);
+    
+    spareErase = 0;
+    legacyFAT = false;
+    
+    //no journal yet: mark block 1 full, so the first change starts one in block 0
+    if(!valid0 && !valid1)
+    {
+        journalBlock = block;
+        journalSeq = 0xffff;
+        journalNext = slots;
         
-        uint32_t end = -1;
-        memcpy(&fileInfo[4], &end, 4);
+        //...unless block 0 has a FAT from a device written without the journal
+        ReadFAT();
+        if(storeCount) MigrateFAT();
+        return;
+    }
+    
+    //sequence numbers wrap
+    bool useBlock1 = valid1 && (!valid0 || (int16_t)(seq1 - seq0) > 0);
+    journalBlock = useBlock1 ? block : 0;
+    journalSeq = useBlock1 ? seq1 : seq0;
+    journalNext = 1;
+    
+    if(!flash->BeginRead(journalBlock + sizeof(JournalRecord), block - sizeof(JournalRecord))) return;
+    
+    JournalRecord records[8];
+    for(uint16_t slot = 1; slot < slots; slot += 8)
+    {
+        uint16_t n = slots - slot < 8 ? slots - slot : 8;
+        flash->ReceiveBytes((uint8_t*)records, n * sizeof(JournalRecord));
         
-        if(start != 0xffffffff)
+        for(uint16_t i = 0; i < n; i++)
         {
-            storeList.Add(Datastore(index, start, end));
+            JournalRecord& record = records[i];
+            if(record.IsFree()) continue;
+            
+            journalNext = slot + i + 1; //appends go after the last slot that's been written
+            if(!record.IsValid()) continue; //torn
+            
+            Datastore* store = FindStore(record.storeNumber);
+            if(store) RemoveStore(store);
+            if(!record.startBlock) continue;
+            
+            uint32_t end = (record.endBlock & ~JOURNAL_RING) * block;
+            if(!AddStore(Datastore(record.storeNumber, record.startBlock * block, end, record.endBlock & JOURNAL_RING))) SerialUSB.println("No room for store.");
         }
     }
     
-    return storeList.GetItemsInContainer();
+    flash->EndRead();
+}
+
+template <class FlashType>
+uint32_t FlashStoreManagerT<FlashType>::WriteJournalRecord(uint32_t address, const JournalRecord& record)
+{
+    return flash->Write(address, (const uint8_t*)&record, sizeof(record));
 }
 
-uint32_t FlashStoreManager::Select(uint16_t storeNumber)
+/*
+ * Writes the live table to the spare block and switches to it, then queues an erase of the full
+ * one so it's ready for next time. The header goes in last: if power fails part way, the old
+ * block still has the latest header and is what the next mount replays.
+ */
+template <class FlashType>
+uint32_t FlashStoreManagerT<FlashType>::CompactJournal(void)
 {
-    currStore = storeList.Find(Datastore(storeNumber));
-    if(currStore) return currStore->endAddress - currStore->firstAddress; //available size
-    else return 0;
+    uint32_t block = flash->GetBlockSize();
+    uint32_t spare = journalBlock ? 0 : block;
+    
+    //erased in the background after the last compaction; since mount, it has to be checked
+    while(spareErase && flash->IsErasePending(spareErase)) flash->Poll();
+    if(!spareErase && !IsErased(spare, block)) EraseRegion(spare, block, false);
+    
+    for(uint16_t i = 0; i < storeCount; i++)
+    {
+        const Datastore& store = stores[byAddress[i]];
+        uint16_t endBlock = store.endAddress / block | (store.ring ? JOURNAL_RING : 0);
+        JournalRecord record(store.storeNumber, store.startAddress / block, endBlock);
+        WriteJournalRecord(spare + (i + 1) * sizeof(JournalRecord), record);
+    }
+    flash->Flush();
+    
+    uint32_t count = WriteJournalRecord(spare, JournalRecord(JOURNAL_HEADER, journalSeq + 1, 0));
+    flash->Flush();
+    
+    spareErase = EraseRegion(journalBlock, block); //0 if it had to be done now
+    
+    journalBlock = spare;
+    journalSeq++;
+    journalNext = storeCount + 1;
+    
+    return count;
 }
 
-uint32_t FlashStoreManager::Write(const BufferArray& buffer)
+/*
+ * Carries the stores in a FAT over to a journal in block 1, by compacting into it as if block 0 were
+ * the active journal block. The FAT stays as it is until the journal's header is written, so a power
+ * cut part way just means doing it again at the next mount; then block 0 is erased in the background.
+ * If a store sits where the journal (or wear table) has to go, nothing is moved or erased: the stores
+ * can still be written and read, but creating and deleting them is refused.
+ */
+template <class FlashType>
+void FlashStoreManagerT<FlashType>::MigrateFAT(void)
+{
+    if(stores[byAddress[0]].startAddress < MetadataSize())
+    {
+        SerialUSB.println("Store table is an old FAT: build with FLASH_FAT_JOURNAL 0 to change stores.");
+        legacyFAT = true;
+        return;
+    }
+    
+    journalBlock = 0;
+    CompactJournal();
+}
+
+/*
+ * Appends a record for a change that's already been made to the table. If the block is full,
+ * compacting writes out the table, which includes the change.
+ */
+template <class FlashType>
+uint32_t FlashStoreManagerT<FlashType>::WriteFATEntry(uint16_t storeNumber, uint32_t start, uint32_t end, bool ring)
+{
+    uint32_t block = flash->GetBlockSize();
+    if(journalNext >= block / sizeof(JournalRecord)) return CompactJournal();
+    
+    JournalRecord record(storeNumber, 0, 0);
+    if(start != 0xffffffff) record = JournalRecord(storeNumber, start / block, end / block | (ring ? JOURNAL_RING : 0));
+    
+    uint32_t count = WriteJournalRecord(journalBlock + journalNext * sizeof(JournalRecord), record);
+    flash->Flush(); //metadata shouldn't sit in a driver buffer
+    
+    journalNext++;
+    
+    return count;
+}
+#else
+template <class FlashType>
+uint32_t FlashStoreManagerT<FlashType>::WriteFATEntry(uint16_t storeNumber, uint32_t start, uint32_t end, bool ring)
+{
+    if(ring) end |= FAT_RING;
+    
+    uint8_t storeInfo[8];
+    memcpy(&storeInfo[0], &start, 4);
+    memcpy(&storeInfo[4], &end, 4);
+    
+    //Write() can only clear bits, so a slot that's held a store before has to be rewritten in place
+    uint8_t old[8];
+    bool clearsOnly = flash->ReadBytes(storeNumber * 8, old, 8) == 8;
+    for(uint8_t i = 0; i < 8; i++)
+    {
+        if((old[i] & storeInfo[i]) != storeInfo[i]) clearsOnly = false;
+    }
+    
+    uint32_t count = clearsOnly ? 0 : flash->Update(storeNumber * 8, storeInfo, 8);
+    if(!count) count = flash->Write(storeNumber * 8, storeInfo, 8); //drivers without Update() get the old behaviour
+    flash->Flush(); //metadata shouldn't sit in a driver buffer
+    
+    return count;
+}
+#endif
+
+template <class FlashType>
+bool FlashStoreManagerT<FlashType>::IsErased(uint32_t address, uint32_t count)
+{
+    if(!flash->BeginRead(address, count)) return false;
+    
+    //one transaction, but stop as soon as something's been written
+    uint8_t chunk[32];
+    bool erased = true;
+    while(count && erased)
+    {
+        uint16_t n = count < sizeof(chunk) ? count : sizeof(chunk);
+        flash->ReceiveBytes(chunk, n);
+        for(uint16_t i = 0; i < n; i++) erased &= chunk[i] == 0xff;
+        count -= n;
+    }
+    
+    flash->EndRead();
+    
+    return erased;
+}
+
+/*
+ * address just past the last byte that isn't 0xff in [address, address + count)
+ */
+template <class FlashType>
+uint32_t FlashStoreManagerT<FlashType>::EndOfData(uint32_t address, uint32_t count)
+{
+    uint32_t end = address;
+    if(!flash->BeginRead(address, count)) return end;
+    
+    uint8_t chunk[32];
+    for(uint32_t i = 0; i < count; )
+    {
+        uint16_t n = count - i < sizeof(chunk) ? count - i : sizeof(chunk);
+        flash->ReceiveBytes(chunk, n);
+        for(uint16_t j = 0; j < n; j++)
+        {
+            if(chunk[j] != 0xff) end = address + i + j + 1;
+        }
+        i += n;
+    }
+    
+    flash->EndRead();
+    
+    return end;
+}
+
+template <class FlashType>
+uint32_t FlashStoreManagerT<FlashType>::CheckpointSegment(const Datastore& store)
+{
+    uint32_t page = flash->GetPageSize();
+    uint32_t pages = (store.endAddress - DataStart(store)) / page;
+    uint32_t bits = page * 8;
+    
+    return ((pages + bits - 1) / bits) * page; //whole pages, so probes stay page aligned
+}
+
+template <class FlashType>
+uint32_t FlashStoreManagerT<FlashType>::ReadCheckpoint(const Datastore& store)
+{
+    uint32_t segments = 0;
+    if(!flash->BeginRead(store.startAddress, flash->GetPageSize())) return 0;
+    
+    for(uint16_t i = 0; i < flash->GetPageSize(); i++)
+    {
+        uint8_t bits = 0;
+        flash->ReceiveBytes(&bits, 1);
+        
+        if(!bits)
+        {
+            segments += 8;
+            continue;
+        }
+        
+        //cleared bits fill from the bottom
+        for( ; !(bits & 1); bits >>= 1) segments++;
+        break;
+    }
+    
+    flash->EndRead();
+    
+    return segments;
+}
+
+/*
+ * Stores are written front to back, so the pages up to the cursor have data and the ones after it
+ * are still erased. A binary search over page-sized probes finds the first erased page in
+ * log2(pages) reads, then the last written page is scanned for the end of the data.
+ * (Data that ends in 0xff bytes will have them written over.)
+ */
+template <class FlashType>
+uint32_t FlashStoreManagerT<FlashType>::RecoverCursor(const Datastore& store)
+{
+    uint32_t lo = DataStart(store); //first page that might not be written
+    uint32_t hi = store.endAddress; //first page known to be erased
+
+#if FLASH_STORE_CHECKPOINTS
+    uint32_t page = flash->GetPageSize();
+    uint32_t segment = CheckpointSegment(store);
+    uint32_t checkpoint = lo + ReadCheckpoint(store) * segment;
+    if(checkpoint > lo && checkpoint <= hi) lo = checkpoint - page; //the last page of a full segment has data
+    
+    //gallop out from the checkpoint to bracket the cursor
+    for(uint32_t step = segment; step < hi - lo; step *= 2)
+    {
+        if(IsErased(lo + step, page))
+        {
+            hi = lo + step;
+            break;
+        }
+        
+        lo += step;
+    }
+#endif
+
+    return FindCursor(lo, hi);
+}
+
+/*
+ * the end of the data in [lo, hi), where data runs from lo and is followed by erased pages
+ */
+template <class FlashType>
+uint32_t FlashStoreManagerT<FlashType>::FindCursor(uint32_t lo, uint32_t hi)
+{
+    uint32_t page = flash->GetPageSize();
+    while(hi - lo > page)
+    {
+        uint32_t mid = lo + ((hi - lo) / page / 2) * page;
+        if(IsErased(mid, page)) hi = mid;
+        else lo = mid;
+    }
+    
+    return EndOfData(lo, hi - lo);
+}
+
+/*
+ * Going round a ring from its head: the block being filled, the erased block ahead of it, then older
+ * data back round to the head (or erased blocks, if it hasn't wrapped yet). So the head is in the
+ * block with data that's followed by an erased one, and the oldest data is two blocks on, if that
+ * block has any. If power failed before the block ahead was erased, no block is erased: then the head
+ * is in the one block that isn't full, and the erase is done now.
+ */
+template <class FlashType>
+void FlashStoreManagerT<FlashType>::RecoverRing(Datastore& store)
+{
+    uint32_t block = flash->GetBlockSize();
+    uint32_t page = flash->GetPageSize();
+    
+    store.currAddress = store.tailAddress = store.startAddress;
+    store.aheadErase = 0;
+    
+    uint32_t headBlock = 0;
+    bool anyErased = false;
+    uint32_t prevBlock = store.endAddress - block;
+    bool prevData = !IsErased(prevBlock, page);
+    for(uint32_t b = store.startAddress; b < store.endAddress; b += block)
+    {
+        bool data = b == prevBlock ? prevData : !IsErased(b, page);
+        if(!data) anyErased = true;
+        if(prevData && !data) headBlock = prevBlock;
+        
+        prevBlock = b;
+        prevData = data;
+    }
+    
+    if(!headBlock && anyErased) return; //empty
+    
+    if(!headBlock)
+    {
+        for(uint32_t b = store.startAddress; b < store.endAddress && !headBlock; b += block)
+        {
+            if(IsErased(b + block - page, page)) headBlock = b;
+        }
+        
+        if(!headBlock) headBlock = store.startAddress; //every block full: can't tell
+    }
+    
+    store.currAddress = FindCursor(headBlock, headBlock + block);
+    if(store.currAddress == headBlock + block) store.currAddress = NextBlock(store, headBlock);
+    
+    uint32_t ahead = NextBlock(store, headBlock);
+    uint32_t oldest = NextBlock(store, ahead);
+    
+    if(!anyErased) store.aheadErase = EraseRegion(ahead, block);
+    
+    if(!IsErased(oldest, page)) store.tailAddress = oldest;
+    
+    //positions count from the oldest byte
+    store.tailCount = 0;
+    store.headCount = store.currAddress >= store.tailAddress ? store.currAddress - store.tailAddress
+                                                             : store.currAddress + (store.endAddress - store.startAddress) - store.tailAddress;
+}
+
+template <class FlashType>
+uint32_t FlashStoreManagerT<FlashType>::Select(uint16_t storeNumber)
+{
+    currStore = FindStore(storeNumber);
+    if(!currStore) return 0;
+    
+    //available size; a ring holds all but the block kept erased ahead of the head
+    if(currStore->ring) return currStore->endAddress - currStore->startAddress - flash->GetBlockSize();
+    return currStore->endAddress - currStore->currAddress;
+}
+
+template <class FlashType>
+uint32_t FlashStoreManagerT<FlashType>::Write(const FlashSegment* segments, uint8_t count)
 {
     //Datastore* store = storeList.Find(Datastore(storeNumber));
     if(!currStore) return 0;
     
-    uint32_t byteCount = flash->Write(currStore->currAddress, buffer); //somewhere needs to check for overrun...
+    uint32_t size = 0;
+    for(uint8_t i = 0; i < count; i++) size += segments[i].size;
+    
+    //the store's erase may not have finished yet (a ring's record can wrap to its start)
+    uint32_t run = size < currStore->endAddress - currStore->currAddress ? size : currStore->endAddress - currStore->currAddress;
+    WaitForErase(currStore->currAddress, run);
+    if(run < size && currStore->ring) WaitForErase(currStore->startAddress, size - run);
+    
+    if(currStore->ring) return WriteRing(segments, count, size);
+    
+    if(size > currStore->endAddress - currStore->currAddress) return 0; //full
+    
+    uint32_t byteCount = flash->Write(currStore->currAddress, segments, count);
     currStore->currAddress += byteCount;
+    FLASH_STAT(bytesAppended += byteCount);
+    
+    return byteCount;
+}
+
+template <class FlashType>
+uint32_t FlashStoreManagerT<FlashType>::WriteRing(const FlashSegment* segments, uint8_t segmentCount, uint32_t count)
+{
+    Datastore& store = *currStore;
+    uint32_t block = flash->GetBlockSize();
+    if(!count || count > block) return 0; //bigger would run into the block being erased
+    
+    uint32_t head = store.currAddress;
+    uint32_t last = head + count - 1;
+    if(last >= store.endAddress) last -= store.endAddress - store.startAddress;
+    
+    //moving into a new block: wait for its erase if it's somehow still going, then erase the next one
+    uint32_t entering = 0;
+    if(!(head & (block - 1))) entering = head;
+    else if((head ^ last) & ~(block - 1)) entering = last & ~(block - 1);
+    
+    if(entering)
+    {
+        while(store.aheadErase && flash->IsErasePending(store.aheadErase)) flash->Poll();
+        store.aheadErase = 0;
+        
+        //before the ring wraps, the block ahead has never been written
+        uint32_t ahead = NextBlock(store, entering);
+        if(store.tailAddress >= ahead && store.tailAddress < ahead + block)
+        {
+            uint32_t tail = NextBlock(store, ahead);
+            store.tailCount += tail > store.tailAddress ? tail - store.tailAddress : tail + (store.endAddress - store.startAddress) - store.tailAddress;
+            store.tailAddress = tail;
+            store.aheadErase = EraseRegion(ahead, block);
+        }
+    }
+    
+    //split where the ring wraps
+    uint32_t byteCount = 0;
+    uint32_t first = store.endAddress - head;
+    if(count <= first) byteCount = flash->Write(head, segments, segmentCount);
+    else
+    {
+        uint32_t address = head;
+        uint32_t offset = 0; //into segment i
+        uint8_t i = 0;
+        while(i < segmentCount)
+        {
+            //up to the end of the segment or of the ring, whichever comes first
+            uint32_t run = segments[i].size - offset;
+            if(run > store.endAddress - address) run = store.endAddress - address;
+        
+            uint32_t n = run ? flash->Write(address, segments[i].data + offset, run) : 0;
+            byteCount += n;
+            if(n != run) break;
+            
+            offset += n;
+            address += n;
+            if(address == store.endAddress) address = store.startAddress;
+            if(offset == segments[i].size)
+            {
+                i++;
+                offset = 0;
+            }
+        }
+    }
+    
+    store.currAddress = head + byteCount;
+    if(store.currAddress >= store.endAddress) store.currAddress -= store.endAddress - store.startAddress;
+    store.headCount += byteCount;
+    FLASH_STAT(bytesAppended += byteCount);
+
+#if FLASH_WEAR_LEVELING
+    //just wrapped
+    if(byteCount && head + byteCount >= store.endAddress && relocating == 0xffff) RelocateRing();
+#endif
     
     return byteCount;
 }
 
-uint32_t FlashStoreManager::DeleteStore(uint16_t storeNumber)
+/*
+ * reads from address onwards, carrying on from the start of the store at its end (for rings)
+ */
+template <class FlashType>
+uint32_t FlashStoreManagerT<FlashType>::ReadWrapped(const Datastore& store, uint32_t address, uint8_t* data, uint32_t count)
+{
+    uint32_t n = store.endAddress - address < count ? store.endAddress - address : count;
+    uint32_t got = flash->ReadBytes(address, data, n);
+    if(got == n && n < count) got += flash->ReadBytes(store.startAddress, data + n, count - n);
+    
+    return got;
+}
+
+template <class FlashType>
+uint8_t FlashStoreManagerT<FlashType>::EraseRegion(uint32_t address, uint32_t size, bool background)
+{
+#if FLASH_WEAR_LEVELING
+    CountWear(address, size);
+#endif
+
+    uint8_t handle = background ? flash->StartErase(address, size) : 0;
+    if(!handle) flash->Erase(address, size);
+    
+    return handle;
+}
+
+template <class FlashType>
+void FlashStoreManagerT<FlashType>::EraseLater(uint32_t address, uint32_t size)
+{
+#if FLASH_WEAR_LEVELING
+    CountWear(address, size);
+#endif
+
+    //behind any already waiting, so they go out in order
+    if(!deferredCount && flash->StartErase(address, size)) return;
+    
+    if(deferredCount < FLASH_DEFERRED_ERASES)
+    {
+        deferred[deferredCount].address = address;
+        deferred[deferredCount].size = size;
+        deferredCount++;
+    }
+    else flash->Erase(address, size); //nowhere to keep it
+}
+
+template <class FlashType>
+void FlashStoreManagerT<FlashType>::StartDeferred(void)
+{
+    uint8_t started = 0;
+    while(started < deferredCount && flash->StartErase(deferred[started].address, deferred[started].size)) started++;
+    
+    deferredCount -= started;
+    for(uint8_t i = 0; i < deferredCount; i++) deferred[i] = deferred[i + started];
+}
+
+template <class FlashType>
+bool FlashStoreManagerT<FlashType>::IsDeferred(uint32_t address, uint32_t size)
+{
+    for(uint8_t i = 0; i < deferredCount; i++)
+    {
+        if(address < deferred[i].address + deferred[i].size && deferred[i].address < address + size) return true;
+    }
+    
+    return false;
+}
+
+template <class FlashType>
+void FlashStoreManagerT<FlashType>::WaitForErase(uint32_t address, uint32_t size)
+{
+    while(IsDeferred(address, size) || flash->IsQueuedForErase(address, size))
+    {
+        if(deferredCount) StartDeferred();
+        flash->Poll();
+    }
+}
+
+template <class FlashType>
+uint32_t FlashStoreManagerT<FlashType>::Checkpoint(void)
+{
+#if FLASH_STORE_CHECKPOINTS
+    if(!currStore || currStore->ring) return 0;
+    
+    Flush(); //only vouch for data that's on the chip
+    
+    uint32_t segments = (currStore->currAddress - DataStart(*currStore)) / CheckpointSegment(*currStore);
+    if(!segments) return 0;
+    
+    //clearing bits that are already clear is harmless, so rewrite the whole prefix, a chunk at a time
+    uint8_t bits[FLASH_CHECKPOINT_CHUNK];
+    uint32_t byteCount = (segments + 7) / 8;
+    for(uint32_t i = 0; i < byteCount; i += sizeof(bits))
+    {
+        uint32_t n = byteCount - i < sizeof(bits) ? byteCount - i : sizeof(bits);
+        memset(bits, 0x00, n);
+        if(i + n == byteCount && segments % 8) bits[n - 1] = 0xff << (segments % 8);
+    
+        flash->Write(currStore->startAddress + i, bits, n);
+    }
+    flash->Flush();
+    
+    return segments;
+#else
+    return 0;
+#endif
+}
+
+template <class FlashType>
+uint32_t FlashStoreManagerT<FlashType>::DeleteStore(uint16_t storeNumber)
 {
     uint32_t deletedByteCount = 0;
-    Datastore* store = storeList.Find(Datastore(storeNumber));
+    Datastore* store = FindStore(storeNumber);
     if(!store)
     {
         SerialUSB.println("Can't find store.");
         return 0;
     }
+#if FLASH_FAT_JOURNAL
+    if(legacyFAT) return 0; //the table can't be changed (see MigrateFAT())
+#endif
 
-    deletedByteCount = flash->Erase(store->startAddress, store->size);
-    BufferArray storeInfo(8);
-    for(uint8_t i = 0; i < 8; i++) storeInfo[i] = 0xff;
-    flash->Write(storeNumber * 8, storeInfo);
-
-    ReadStoresFromFlash();
+    //erase in the background (or once the queue has room); the region stays off limits until it's done
+    deletedByteCount = store->endAddress - store->startAddress;
+    EraseLater(store->startAddress, deletedByteCount);
+    
+    RemoveStore(store); //first, so a compaction leaves it out
+    WriteFATEntry(storeNumber, 0xffffffff, 0xffffffff);
     
     return deletedByteCount;
 }
 
-uint32_t FlashStoreManager::CreateStore(uint16_t fileNum, uint32_t sizeReq)
+template <class FlashType>
+uint32_t FlashStoreManagerT<FlashType>::CreateStore(uint16_t fileNum, uint32_t sizeReq, bool ring)
 {
+#if FLASH_FAT_JOURNAL
+    if(legacyFAT) return 0; //the table can't be changed (see MigrateFAT())
+#endif
+
     //check if file number is valid
     //first block acts as rudimentary FAT; 8 bytes per store => max file is blocksize / 8
-    uint16_t maxFileNum = flash->bytesPerBlock / 8;
-    if(fileNum > maxFileNum) return 0;
+    //(but no more than the table has slots for: a striped array's blocks hold more)
+    uint32_t maxFileNum = flash->GetBlockSize() / 8;
+    if(maxFileNum > FLASH_FAT_SLOTS) maxFileNum = FLASH_FAT_SLOTS;
+    if(fileNum >= maxFileNum) return 0;
     
     //check if file number is available
-    //first refresh list
-    ReadStoresFromFlash();
-    //then check if the number is taken
-    if(storeList.Find(Datastore(fileNum))) return 0;
-    
-    //now find an chunk of unallocated memory
-    //for now, just check if there is memory after the last file (which will help distribute writes, as well)
-    uint32_t firstFreeMem = flash->bytesPerBlock; //first block reserved for "FAT"
-    if(storeList.GetTail()) firstFreeMem = storeList.GetTail()->endAddress + 1;
+    if(FindStore(fileNum)) return 0;
+    if(storeCount == FLASH_MAX_STORES) return 0;
     
     //check for space
-    //make sizeReq integral number of blocks
-    uint16_t blocks = sizeReq / flash->bytesPerBlock;
-    if(sizeReq % flash->bytesPerBlock) blocks++;
-    sizeReq = blocks * flash->bytesPerBlock;
+    //make sizeReq integral number of blocks (always a power of two)
+    uint32_t blockMask = flash->GetBlockSize() - 1;
+    sizeReq = (sizeReq + blockMask) & ~blockMask;
+    if(ring && sizeReq < 3 * flash->GetBlockSize()) sizeReq = 3 * flash->GetBlockSize(); //filling, erased ahead, and the oldest
     
-    if((flash->byteCount - firstFreeMem) < sizeReq) return 0; //could be made a lot smarter...
+    //now find an chunk of unallocated memory
+    uint32_t firstFreeMem = Allocate(sizeReq);
+    if(!firstFreeMem) return 0;
     
     //if we've made it this far, we can make a store
-    //create the FAT entry
-    Datastore newStore(fileNum, firstFreeMem, firstFreeMem + sizeReq);
-    storeList.Add(newStore);
-
-    BufferArray storeInfo(8);
-    memcpy(&storeInfo[0], &newStore.startAddress, 4);
-    memcpy(&storeInfo[4], &newStore.endAddress, 4);
-    flash->Write(fileNum * 8, storeInfo);
+    //record it
+    Datastore* newStore = AddStore(Datastore(fileNum, firstFreeMem, firstFreeMem + sizeReq, ring));
+    if(!newStore) return 0;
+    
+    newStore->currAddress = newStore->tailAddress = DataStart(*newStore);
+    WriteFATEntry(fileNum, newStore->startAddress, newStore->endAddress, ring);
     
-    //erase the relevant memory
-    flash->Erase(newStore.startAddress, sizeReq);
+    //erase the relevant memory in the background (or once the queue has room); writes to the store are refused until it's done
+    EraseLater(newStore->startAddress, sizeReq);
     
     return Select(fileNum);
 }
+
+template <class FlashType>
+Datastore* DatastoreReaderT<FlashType>::GetStore(void)
+{
+    Datastore* store = manager->FindStore(storeNumber);
+    if(store && manager->DataStart(*store) != startAddress) store = NULL; //a different store by the same number
+    if(store && store->ring && (int32_t)(store->tailCount - origin) < 0) store = NULL; //remounted: the count started over
+    
+    return store;
+}
+
+template <class FlashType>
+bool DatastoreReaderT<FlashType>::Open(uint16_t number)
+{
+    Close();
+    
+    Datastore* store = manager->FindStore(number);
+    if(!store) return false;
+    
+    storeNumber = number;
+    startAddress = manager->DataStart(*store);
+    origin = store->ring ? store->tailCount : 0;
+    position = 0;
+    
+    return true;
+}
+
+template <class FlashType>
+uint32_t DatastoreReaderT<FlashType>::Size(void)
+{
+    Datastore* store = GetStore();
+    if(!store) return 0;
+    
+    if(store->ring) return store->headCount - origin;
+    return store->currAddress - startAddress;
+}
+
+template <class FlashType>
+uint32_t DatastoreReaderT<FlashType>::Dropped(Datastore* store)
+{
+    return store->ring ? store->tailCount - origin : 0;
+}
+
+/*
+ * reads from position offset, wrapping at the end of a ring; a ring's offset can't be behind its tail
+ */
+template <class FlashType>
+uint32_t DatastoreReaderT<FlashType>::ReadAt(Datastore* store, uint32_t offset, uint8_t* data, uint32_t count)
+{
+    if(!store->ring) return manager->ReadWrapped(*store, startAddress + offset, data, count);
+    
+    uint32_t address = store->tailAddress + (origin + offset - store->tailCount);
+    if(address >= store->endAddress) address -= store->endAddress - store->startAddress;
+    
+    return manager->ReadWrapped(*store, address, data, count);
+}
+
+template <class FlashType>
+bool DatastoreReaderT<FlashType>::Seek(uint32_t offset)
+{
+    if(!GetStore() || offset > Size()) return false;
+    
+    position = offset;
+    
+    return true;
+}
+
+template <class FlashType>
+uint32_t DatastoreReaderT<FlashType>::Read(uint8_t* data, uint32_t count)
+{
+    Datastore* store = GetStore();
+    if(!store) return 0;
+    
+    //never past the data, and never before what a ring still holds
+    uint32_t size = Size();
+    uint32_t dropped = Dropped(store);
+    if(position < dropped) position = dropped;
+    if(position >= size) return 0;
+    if(count > size - position) count = size - position;
+    
+    uint32_t done = 0;
+    while(done < count)
+    {
+        //whatever the buffer already has
+        if(position >= chunkStart && position < chunkStart + chunkCount)
+        {
+            uint32_t n = chunkStart + chunkCount - position;
+            if(n > count - done) n = count - done;
+            
+            memcpy(data + done, &chunk[position - chunkStart], n);
+            done += n;
+            position += n;
+            continue;
+        }
+        
+        //big reads go in one burst, straight to the caller
+        if(count - done >= FLASH_READER_CHUNK)
+        {
+            uint32_t n = ReadAt(store, position, data + done, count - done);
+            done += n;
+            position += n;
+            break;
+        }
+        
+        //refill, up to the cursor
+        uint32_t n = size - position < FLASH_READER_CHUNK ? size - position : FLASH_READER_CHUNK;
+        chunkStart = position;
+        chunkCount = ReadAt(store, position, chunk, n);
+        if(!chunkCount) break; //being erased
+    }
+    
+    return done;
+}
+
+template <class FlashType>
+uint32_t StoreQueueT<FlashType>::Service(bool all)
+{
+    uint32_t page = manager->flash->GetPageSize();
+    
+    uint32_t written = 0;
+    while(manager->currStore)
+    {
+        uint16_t used = Head() - tail;
+        
+        //line batches up with the store's pages, so each one is a single program
+        uint16_t count = page - (manager->currStore->currAddress & (page - 1));
+        if(used < count)
+        {
+            if(!all || !used) break;
+            count = used;
+        }
+        
+        //straight out of the buffer: the part up to its end, then what wrapped to the start
+        uint16_t at = tail & (FLASH_QUEUE_SIZE - 1);
+        uint16_t first = FLASH_QUEUE_SIZE - at;
+        if(first > count) first = count;
+        FlashSegment segments[2] = {{&data[at], first}, {data, (uint32_t)(count - first)}};
+        
+        uint32_t byteCount = manager->Write(segments, 2);
+        
+        FLASH_QUEUE_BARRIER(); //done with the bytes before Push() can reuse them
+        FLASH_QUEUE_ATOMIC {tail += byteCount;}
+        written += byteCount;
+        
+        if(byteCount < count) break;
+    }
+    
+    return written;
+}
+
+#if FLASH_WEAR_LEVELING
+template <class FlashType>
+void FlashStoreManagerT<FlashType>::CountWear(uint32_t address, uint32_t size)
+{
+    uint32_t block = flash->GetBlockSize();
+    for(uint32_t b = address / block; b < (address + size) / block && b < FLASH_WEAR_BLOCKS; b++)
+    {
+        if(wear[b] != 0xffff) wear[b]++;
+        wearDirty++;
+    }
+}
+
+template <class FlashType>
+uint32_t FlashStoreManagerT<FlashType>::WearOf(uint32_t address, uint32_t size)
+{
+    uint32_t sum = 0;
+    for(uint32_t a = address; a < address + size; a += flash->GetBlockSize()) sum += Wear(a);
+    
+    return sum;
+}
+
+/*
+ * Two copies sit after the store table, each a header and then the counts. Saving writes the spare
+ * copy, header last, so the one in use is intact until the new one is complete; the old one is then
+ * erased in the background, ready for next time.
+ */
+template <class FlashType>
+void FlashStoreManagerT<FlashType>::LoadWear(void)
+{
+    memset(wear, 0, sizeof(wear));
+    wearCopy = 0;
+    wearDirty = 0;
+    wearSpareErase = 0;
+    
+    uint16_t blocks = WearBlocks();
+    for(uint8_t i = 0; i < 2; i++)
+    {
+        uint32_t copy = TableSize() + i * WearCopySize();
+        
+        JournalRecord header;
+        if(flash->ReadBytes(copy, (uint8_t*)&header, sizeof(header)) != sizeof(header)) continue;
+        if(header.storeNumber != WEAR_HEADER || !header.IsValid() || header.endBlock != blocks) continue;
+        if(wearCopy && (int16_t)(header.startBlock - wearSeq) <= 0) continue; //sequence numbers wrap
+        
+        wearCopy = copy;
+        wearSeq = header.startBlock;
+    }
+    
+    if(!wearCopy || !flash->BeginRead(wearCopy + sizeof(JournalRecord), blocks * sizeof(uint16_t))) return;
+    
+    flash->ReceiveBytes((uint8_t*)wear, blocks * sizeof(uint16_t));
+    flash->EndRead();
+}
+
+template <class FlashType>
+bool FlashStoreManagerT<FlashType>::SaveWear(void)
+{
+    uint32_t size = WearCopySize();
+    uint32_t spare = wearCopy == TableSize() ? TableSize() + size : TableSize();
+    
+    //erased in the background after the last save; since mount, it has to be checked
+    while(wearSpareErase && flash->IsErasePending(wearSpareErase)) flash->Poll();
+    if(!wearSpareErase && !IsErased(spare, size)) EraseRegion(spare, size, false);
+    
+    uint16_t blocks = WearBlocks();
+    uint32_t bytes = blocks * sizeof(uint16_t);
+    if(flash->Write(spare + sizeof(JournalRecord), (const uint8_t*)wear, bytes) != bytes) return false;
+    flash->Flush();
+    
+    JournalRecord record(WEAR_HEADER, wearSeq + 1, blocks);
+    if(flash->Write(spare, (const uint8_t*)&record, sizeof(record)) != sizeof(record)) return false;
+    flash->Flush();
+    
+    wearDirty = 0;
+    wearSpareErase = wearCopy ? EraseRegion(wearCopy, size) : 0; //counts towards the next save
+    wearCopy = spare;
+    wearSeq++;
+    
+    return true;
+}
+
+template <class FlashType>
+uint16_t FlashStoreManagerT<FlashType>::GetWearSpread(uint16_t* least, uint16_t* mean)
+{
+    uint16_t blocks = WearBlocks();
+    uint16_t most = 0;
+    uint16_t fewest = 0xffff;
+    uint32_t total = 0;
+    
+    for(uint16_t b = 0; b < blocks; b++)
+    {
+        if(wear[b] > most) most = wear[b];
+        if(wear[b] < fewest) fewest = wear[b];
+        total += wear[b];
+    }
+    
+    if(least) *least = blocks ? fewest : 0;
+    if(mean) *mean = blocks ? total / blocks : 0;
+    
+    return most;
+}
+
+template <class FlashType>
+void FlashStoreManagerT<FlashType>::DumpWear(Print& out)
+{
+    uint16_t least = 0;
+    uint16_t mean = 0;
+    uint16_t most = GetWearSpread(&least, &mean);
+    
+    out.print(F("wear_blocks "));
+    out.println(WearBlocks());
+    out.print(F("wear_min "));
+    out.println(least);
+    out.print(F("wear_mean "));
+    out.println(mean);
+    out.print(F("wear_max "));
+    out.println(most);
+    
+    //the store table takes every metadata change, so it's worth watching on its own
+    uint16_t tableMost = 0;
+    for(uint32_t a = 0; a < TableSize(); a += flash->GetBlockSize())
+    {
+        if(Wear(a) > tableMost) tableMost = Wear(a);
+    }
+    
+    out.print(F("wear_table_max "));
+    out.println(tableMost);
+}
+
+/*
+ * Called as a ring wraps. If the least-worn free space that would hold it is worn FLASH_WEAR_MARGIN
+ * erases a block less than the ring, that space is reserved as the ring's new home and the move
+ * starts; the write doesn't wait for any of it. Poll() then erases the target a block at a time and
+ * copies the ring across a page at a time, while the ring carries on where it is, and switches the
+ * ring over once the copy has caught up with the head (StepRelocation()). Readers follow the ring
+ * in its old blocks until the switch; after it they've lost it, as if it had been deleted, and have
+ * to be opened again.
+ */
+template <class FlashType>
+void FlashStoreManagerT<FlashType>::RelocateRing(void)
+{
+#if FLASH_FAT_JOURNAL
+    if(legacyFAT) return; //the switch couldn't be recorded
+#endif
+
+    uint32_t size = currStore->endAddress - currStore->startAddress;
+    uint32_t blocks = size / flash->GetBlockSize();
+    
+    uint8_t policy = allocPolicy;
+    uint32_t cursor = allocCursor;
+    allocPolicy = ALLOC_LEAST_WORN;
+    uint32_t target = Allocate(size);
+    allocPolicy = policy;
+    
+    if(!target || WearOf(currStore->startAddress, size) <= WearOf(target, size) + (uint32_t)FLASH_WEAR_MARGIN * blocks)
+    {
+        allocCursor = cursor;
+        return;
+    }
+    
+    relocating = currStore->storeNumber;
+    relocateFrom = currStore->startAddress;
+    relocateTarget = target;
+    relocateEnd = target + size;
+    relocateBase = relocateCopied = relocateErased = currStore->tailCount;
+    relocateErase = 0;
+}
+    
+template <class FlashType>
+void FlashStoreManagerT<FlashType>::StepRelocation(void)
+{
+    Datastore* store = FindStore(relocating);
+    if(!store || store->startAddress != relocateFrom || !store->ring)
+    {
+        relocating = 0xffff; //deleted
+        return;
+    }
+    
+    if(relocateErase && flash->IsErasePending(relocateErase)) return;
+    relocateErase = 0;
+    
+    uint32_t size = store->endAddress - store->startAddress;
+    uint32_t block = flash->GetBlockSize();
+    
+    //whatever the ring has erased since doesn't need copying
+    if((int32_t)(store->tailCount - relocateCopied) > 0) relocateCopied = store->tailCount;
+    
+    /*
+     * The target is erased a block at a time just ahead of the copy, and again on the next lap if the
+     * copy gets that far; at the switch, everything from the head round to the tail has to be erased,
+     * like the ring's own. Only with the queue empty, so the ring's erase ahead never waits behind one.
+     */
+    uint32_t ready = relocateCopied != store->headCount ? relocateCopied + 1 : store->tailCount + size;
+    if((int32_t)(ready - relocateErased) > 0)
+    {
+        //the ring is outrunning the copy: rather than wear the target out chasing it, try again next lap
+        if(relocateErased - relocateBase >= 2 * size)
+        {
+            relocating = 0xffff;
+            return;
+        }
+        
+        if(flash->IsErasing()) return;
+        
+        //a lap or more behind: every block needs erasing anyway, so start the lap from here
+        if(ready - relocateErased > size) relocateErased = ready - size - ((ready - size - relocateBase) & (block - 1));
+        
+        uint32_t address = RelocatedAddress(relocateErased, size);
+        relocateErase = flash->StartErase(address, block);
+        if(!relocateErase) return;
+        
+        CountWear(address, block);
+        relocateErased += block;
+        return;
+    }
+    
+    //up to the end of a page of the target
+    uint32_t page = flash->GetPageSize();
+    uint32_t end = relocateCopied + page - ((relocateCopied - relocateBase) & (page - 1));
+    if(end - relocateCopied > store->headCount - relocateCopied) end = store->headCount;
+    
+    while(relocateCopied != end)
+    {
+        uint8_t chunk[FLASH_READER_CHUNK];
+        uint16_t n = end - relocateCopied < FLASH_READER_CHUNK ? end - relocateCopied : FLASH_READER_CHUNK;
+        
+        uint32_t from = store->tailAddress + (relocateCopied - store->tailCount);
+        if(from >= store->endAddress) from -= size;
+        
+        //the ring may be erasing its oldest block: try again next time
+        if(ReadWrapped(*store, from, chunk, n) != n) return;
+        if(flash->Write(RelocatedAddress(relocateCopied, size), chunk, n) != n) return;
+        
+        relocateCopied += n;
+    }
+    
+    if(relocateCopied != store->headCount) return;
+    
+    //caught up (and erased round to the tail, above): switch the ring over
+    Datastore old = *store;
+    bool current = currStore == store;
+    relocating = 0xffff;
+    
+    RemoveStore(store);
+    Datastore* ring = AddStore(Datastore(old.storeNumber, relocateTarget, relocateTarget + size, true));
+    if(!ring) return; //can't happen, with its slot just freed; the FAT still has the old region
+    
+    ring->currAddress = RelocatedAddress(old.headCount, size);
+    ring->tailAddress = RelocatedAddress(old.tailCount, size);
+    ring->headCount = old.headCount;
+    ring->tailCount = old.tailCount;
+    if(current) currStore = ring;
+    WriteFATEntry(old.storeNumber, relocateTarget, relocateTarget + size, true);
+    
+    EraseLater(old.startAddress, size);
+}
+#endif
+
+#if FLASH_INSTRUMENTATION
+template <class FlashType>
+void FlashStoreManagerT<FlashType>::DumpStats(Print& out)
+{
+    out.print(F("bytes_appended "));
+    out.println(bytesAppended);
+    mountLatency.Dump(out, "mount_latency");
+    
+    flash->DumpStats(out);
+}
+#endif
+
+template class FlashStoreManagerT<Flash>;
+template class FlashStoreManagerT<FlashAT25DF641A>;
+template class FlashStoreManagerT<FlashAT45DB321E>;
+template class FlashStoreManagerT<FlashArray>;
+
+template class DatastoreReaderT<Flash>;
+template class DatastoreReaderT<FlashAT25DF641A>;
+template class DatastoreReaderT<FlashAT45DB321E>;
+template class DatastoreReaderT<FlashArray>;
+
+template class StoreQueueT<Flash>;
+template class StoreQueueT<FlashAT25DF641A>;
+template class StoreQueueT<FlashAT45DB321E>;
+template class StoreQueueT<FlashArray>;
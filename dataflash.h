@@ -9,7 +9,116 @@
 #define dataflash_h
 
 #include <flash.h>
-#include <TList.h>
+
+#ifndef FLASH_MAX_STORES
+#define FLASH_MAX_STORES 64 //size of the in-RAM store table
+#endif
+
+#ifndef FLASH_FAT_SLOTS
+#define FLASH_FAT_SLOTS 512 //store numbers: 8 bytes per entry in a 4K FAT block
+#endif
+
+/*
+ * With the journal on, the store table is kept in blocks 0 and 1 as a log of 8-byte create and
+ * delete records. A change appends one record and needs no erase; when the active block fills,
+ * the live table is written to the other one and the full block is erased in the background.
+ * Off, block 0 holds the original FAT: an 8-byte slot per store number, rewritten in place.
+ * Changes the on-flash layout. With the journal on, a device written without it is converted at
+ * mount if block 1 is free, and otherwise mounted with its stores fixed (see MigrateFAT()).
+ */
+#ifndef FLASH_FAT_JOURNAL
+#define FLASH_FAT_JOURNAL 1
+#endif
+
+#if FLASH_FAT_JOURNAL && FLASH_MAX_STORES > 511
+#error "a compacted journal has to fit in one 4K block: 511 stores at most"
+#endif
+
+/*
+ * With checkpoints on, each store's first page holds a bitmap: bit i (LSB first) is cleared once
+ * segment i of the store is full. Clearing bits needs no erase, and at mount it bounds the search
+ * for the append cursor from below. Changes the on-flash layout, so pick one setting per device.
+ */
+#ifndef FLASH_STORE_CHECKPOINTS
+#define FLASH_STORE_CHECKPOINTS 0
+#endif
+
+#ifndef FLASH_CHECKPOINT_CHUNK
+#define FLASH_CHECKPOINT_CHUNK 32 //stack buffer Checkpoint() writes the bitmap through, a piece at a time
+#endif
+
+/*
+ * Wear leveling keeps a count of erases for every block the manager erases: in RAM (two bytes a block,
+ * for up to FLASH_WEAR_BLOCKS) and in a table on flash just after the store table, which Poll() saves
+ * every FLASH_WEAR_SAVE_INTERVAL erases. New stores go where the blocks are least worn, and a ring
+ * store worn FLASH_WEAR_MARGIN erases a block more than the best free space moves there after it wraps,
+ * copied across by Poll() while the ring carries on.
+ * Changes the on-flash layout, so pick one setting per device.
+ */
+#ifndef FLASH_WEAR_LEVELING
+#define FLASH_WEAR_LEVELING 0
+#endif
+
+#ifndef FLASH_WEAR_BLOCKS
+#define FLASH_WEAR_BLOCKS 2048 //8MB of 4K blocks
+#endif
+
+#ifndef FLASH_WEAR_SAVE_INTERVAL
+#define FLASH_WEAR_SAVE_INTERVAL 64
+#endif
+
+#ifndef FLASH_WEAR_MARGIN
+#define FLASH_WEAR_MARGIN 1000 //about 1% of the rated endurance
+#endif
+
+#ifndef FLASH_DEFERRED_ERASES
+#define FLASH_DEFERRED_ERASES 8 //store erases held for Poll() while the driver's queue is full
+#endif
+
+#ifndef FLASH_READER_CHUNK
+#define FLASH_READER_CHUNK 128 //a DatastoreReader's buffer; reads at least this big skip it
+#endif
+
+#ifndef FLASH_QUEUE_SIZE
+#define FLASH_QUEUE_SIZE 1024 //a StoreQueue's buffer: a power of two, 32K at most
+#endif
+
+#if (FLASH_QUEUE_SIZE & (FLASH_QUEUE_SIZE - 1)) || FLASH_QUEUE_SIZE > 32768
+#error "FLASH_QUEUE_SIZE has to be a power of two, 32K at most"
+#endif
+
+/*
+ * What a StoreQueue needs to share its indices with an interrupt handler. On a single core only the
+ * compiler can reorder memory accesses; elsewhere (the host, dual-core parts such as the RP2040 or
+ * the Portenta's H7) it takes a real fence. Only the cores known to be single get the cheap one.
+ * AVR can't load or store 16 bits in one go, so the main-loop side masks interrupts around that.
+ */
+#if defined(__AVR__) || defined(ARDUINO_ARCH_SAMD) || defined(TEENSYDUINO) || defined(ARDUINO_ARCH_NRF52)
+#define FLASH_QUEUE_BARRIER() asm volatile("" ::: "memory")
+#else
+#define FLASH_QUEUE_BARRIER() __sync_synchronize()
+#endif
+
+#if defined(__AVR__)
+#include <util/atomic.h>
+#define FLASH_QUEUE_ATOMIC ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+#else
+#define FLASH_QUEUE_ATOMIC
+#endif
+
+//placement policies for new stores
+#define ALLOC_NEXT_FIT  0 //first hole at or after where the last store went, wrapping around
+#define ALLOC_BEST_FIT  1 //smallest hole that fits; ties go to the next one round from the last store
+#define ALLOC_LEAST_WORN 2 //block-aligned spot with the fewest erases (FLASH_WEAR_LEVELING); ties as above
+
+//index into the store table; NO_STORE marks an unused store number
+#if FLASH_MAX_STORES < 255
+typedef uint8_t StoreIndex;
+#define NO_STORE 0xff
+#else
+typedef uint16_t StoreIndex;
+#define NO_STORE 0xffff
+#endif
 
 /*
  * A Datastore is essentially a 'file' of data, but since this isn't a file system, per se,
@@ -20,20 +129,29 @@ struct Datastore
 protected:
     uint16_t storeNumber = 0xffff;
     uint32_t startAddress = -1;
-    uint32_t endAddress = -1; //either last byte or last byte + 1...tbd
+    uint32_t endAddress = -1; //last byte + 1, so the next store can start here
     uint32_t size = 0; //in bytes, since page sizes vary by flash chip...REDUNDANT!!!
     uint32_t currAddress = -1;
     
+    //ring stores wrap around, erasing the oldest block just ahead of currAddress
+    bool ring = false;
+    uint32_t tailAddress = -1; //oldest byte still held
+    uint8_t aheadErase = 0; //handle for the erase of the block ahead, 0 if none is queued
+    uint32_t headCount = 0; //bytes a ring has taken since it was mounted or created...
+    uint32_t tailCount = 0; //...and erased, so readers can tell one lap from the next
+
 public:
     Datastore(void) : storeNumber(-1) {}
     Datastore(uint16_t number) : storeNumber(number) {}
-    Datastore(uint16_t number, uint32_t startAddr, uint32_t endAddr)
+    Datastore(uint16_t number, uint32_t startAddr, uint32_t endAddr, bool isRing = false)
     {
         storeNumber = number;
         startAddress = startAddr;
         endAddress = endAddr;
-        size = endAddr - startAddr + 1;
+        size = endAddr - startAddr;
         currAddress = startAddress;
+        ring = isRing;
+        tailAddress = startAddress;
     }
  
     String Display(void)
@@ -45,33 +163,428 @@ public:
     bool operator == (const Datastore& store) { return storeNumber == store.storeNumber; }
     bool operator > (const Datastore& store) { return startAddress > store.startAddress; }
 
-    friend class FlashStoreManager;
+    template <class> friend class FlashStoreManagerT;
+    template <class> friend class DatastoreReaderT;
+    template <class> friend class StoreQueueT;
 };
 
-class FlashStoreManager// : virtual Flash
+/*
+ * One entry in the journal. Block numbers keep it to 8 bytes, the size of a FAT slot; block 0 never
+ * holds a store, so a start of 0 means the store was deleted. The first slot of each journal block
+ * is a header whose startBlock is a sequence number: the block with the later one is active.
+ */
+#define JOURNAL_HEADER 0xfffe
+#define WEAR_HEADER 0xfffd //heads a saved wear table: startBlock is the sequence number, endBlock the block count
+#define JOURNAL_RING 0x8000 //in endBlock: a ring store
+
+#define FAT_RING 0x80000000 //in a FAT entry's end address: a ring store
+
+struct JournalRecord
+{
+    uint16_t storeNumber = 0xffff; //0xffff throughout: a free slot
+    uint16_t startBlock = 0xffff;
+    uint16_t endBlock = 0xffff;
+    uint16_t check = 0xffff; //catches a record torn by a power cut
+    
+    JournalRecord(void) {}
+    JournalRecord(uint16_t number, uint16_t start, uint16_t end)
+        : storeNumber(number), startBlock(start), endBlock(end), check(~(number ^ start ^ end)) {}
+    
+    bool IsFree(void) {return (storeNumber & startBlock & endBlock & check) == 0xffff;}
+    bool IsValid(void) {return check == (uint16_t)~(storeNumber ^ startBlock ^ endBlock);}
+};
+
+/*
+ * walks the stores in address order
+ */
+class DatastoreIterator
 {
 protected:
-    Flash* flash = NULL; //pointer to the flash memory -- this let's us swap physical memory more easily than deriving
-    TSList<Datastore> storeList; //note that the "current" store is always the last one -- this is not a file system
+    Datastore* stores;
+    const StoreIndex* order;
+    uint16_t count;
+    uint16_t index = 0;
+    
+public:
+    DatastoreIterator(Datastore* st, const StoreIndex* ord, uint16_t n) : stores(st), order(ord), count(n) {}
+    
+    Datastore* Next(void) {return index < count ? &stores[order[index++]] : NULL;}
+    void Reset(void) {index = 0;}
+};
+
+/*
+ * FlashType is what the manager talks to. The default, Flash, takes any driver through virtual
+ * calls; binding to a driver (FlashStoreManagerT<FlashAT25DF641A>) makes every call to the chip
+ * direct and turns the block and page arithmetic into constants. The implementation is compiled
+ * for Flash, both drivers and FlashArray at the bottom of dataflash.cpp.
+ */
+template <class FlashType = Flash> class FlashStoreManagerT// : virtual Flash
+{
+protected:
+    FlashType* flash = NULL; //pointer to the flash memory -- this let's us swap physical memory more easily than deriving
+    
+    /*
+     * The journal (or FAT) is read once at mount and the table is authoritative after that:
+     * CreateStore and DeleteStore update it and write through to flash.
+     */
+    Datastore stores[FLASH_MAX_STORES]; //unordered, so pointers stay put when others come and go
+    uint16_t storeCount = 0;
     Datastore* currStore = NULL;
     
+    StoreIndex slotIndex[FLASH_FAT_SLOTS]; //store number => table entry, for constant-time lookup
+    StoreIndex byAddress[FLASH_MAX_STORES]; //table entries sorted by start address, for allocation
+    
+    Datastore* FindStore(uint16_t storeNumber)
+    {
+        if(storeNumber >= FLASH_FAT_SLOTS || slotIndex[storeNumber] == NO_STORE) return NULL;
+        return &stores[slotIndex[storeNumber]];
+    }
+    
+    uint16_t LowerBound(uint32_t address); //first position in byAddress starting at or after address
+    uint32_t NextFreeRegion(uint32_t address, uint32_t& length);
+    
+    uint8_t allocPolicy = FLASH_WEAR_LEVELING ? ALLOC_LEAST_WORN : ALLOC_NEXT_FIT;
+    uint32_t allocCursor = 0; //end of the last store placed; placement rotates from here to spread wear
+    uint32_t Allocate(uint32_t size);
+    
+    //append cursor recovery at mount
+    uint32_t DataStart(const Datastore& store) {return store.startAddress + (FLASH_STORE_CHECKPOINTS && !store.ring ? flash->GetPageSize() : 0);}
+    uint32_t CheckpointSegment(const Datastore& store);
+    uint32_t ReadCheckpoint(const Datastore& store);
+    bool IsErased(uint32_t address, uint32_t count);
+    uint32_t EndOfData(uint32_t address, uint32_t count);
+    uint32_t FindCursor(uint32_t lo, uint32_t hi);
+    uint32_t RecoverCursor(const Datastore& store);
+    
+    //ring stores
+    uint32_t NextBlock(const Datastore& store, uint32_t address)
+    {
+        address = (address & ~(uint32_t)(flash->GetBlockSize() - 1)) + flash->GetBlockSize();
+        return address == store.endAddress ? store.startAddress : address;
+    }
+    
+    void RecoverRing(Datastore& store);
+    uint32_t WriteRing(const FlashSegment* segments, uint8_t count, uint32_t size);
+    
+    uint32_t ReadWrapped(const Datastore& store, uint32_t address, uint8_t* data, uint32_t count);
+    
+    Datastore* AddStore(const Datastore& store);
+    void RemoveStore(Datastore* store);
+    
+    //every erase the manager does goes through here, so it can be counted; returns the handle
+    uint8_t EraseRegion(uint32_t address, uint32_t size, bool background = true);
+    
+    /*
+     * Stores are erased when they're created and deleted, and nothing waits on those erases but writes
+     * to the store. When the driver's queue is full they wait here instead of blocking the caller, and
+     * Poll() hands them on in order as it drains. A write that gets to a store before its erase has
+     * finished sees the erase through first (WaitForErase()), so a caller that never polls still
+     * loses nothing; it just waits where it would have waited in CreateStore().
+     */
+    struct DeferredErase
+    {
+        uint32_t address;
+        uint32_t size;
+    };
+    
+    DeferredErase deferred[FLASH_DEFERRED_ERASES];
+    uint8_t deferredCount = 0;
+    
+    void EraseLater(uint32_t address, uint32_t size);
+    void StartDeferred(void);
+    bool IsDeferred(uint32_t address, uint32_t size);
+    void WaitForErase(uint32_t address, uint32_t size);
+    
+    //blocks at the bottom of the chip that hold the store table (and wear table) rather than stores
+    uint32_t TableSize(void) {return (FLASH_FAT_JOURNAL ? 2 : 1) * flash->GetBlockSize();}
+#if FLASH_WEAR_LEVELING
+    uint32_t MetadataSize(void) {return TableSize() + 2 * WearCopySize();}
+#else
+    uint32_t MetadataSize(void) {return TableSize();}
+#endif
+    uint32_t WriteFATEntry(uint16_t storeNumber, uint32_t start, uint32_t end, bool ring = false); //start 0xffffffff deletes
+    void ReadFAT(void);
+
+#if FLASH_FAT_JOURNAL
+    uint32_t journalBlock = 0; //address of the active journal block
+    uint16_t journalSeq = 0; //its sequence number
+    uint16_t journalNext = 0; //first free slot in it
+    uint8_t spareErase = 0; //handle for the background erase of the other block, 0 if there isn't one
+    bool legacyFAT = false; //mounted an old FAT that couldn't be carried over: the table is read-only
+    
+    bool ReadJournalHeader(uint32_t address, uint16_t& seq);
+    void ReplayJournal(void);
+    void MigrateFAT(void);
+    uint32_t WriteJournalRecord(uint32_t address, const JournalRecord& record);
+    uint32_t CompactJournal(void);
+#endif
+    
+#if FLASH_WEAR_LEVELING
+    uint16_t wear[FLASH_WEAR_BLOCKS]; //erases of each block, saturating
+    uint32_t wearCopy = 0; //address of the saved table in use, 0 if there isn't one yet
+    uint16_t wearSeq = 0;
+    uint16_t wearDirty = 0; //erases counted since the last save
+    uint8_t wearSpareErase = 0; //handle for the background erase of the other copy
+    
+    uint16_t WearBlocks(void)
+    {
+        uint32_t blocks = flash->GetByteCount() / flash->GetBlockSize();
+        return blocks < FLASH_WEAR_BLOCKS ? blocks : FLASH_WEAR_BLOCKS;
+    }
+    
+    //a saved copy: header, then the counts, in whole blocks
+    uint32_t WearCopySize(void)
+    {
+        uint32_t blockMask = flash->GetBlockSize() - 1;
+        return (sizeof(JournalRecord) + WearBlocks() * sizeof(uint16_t) + blockMask) & ~blockMask;
+    }
+    
+    uint16_t Wear(uint32_t address)
+    {
+        uint32_t block = address / flash->GetBlockSize();
+        return block < FLASH_WEAR_BLOCKS ? wear[block] : 0;
+    }
+    
+    uint32_t WearOf(uint32_t address, uint32_t size);
+    void CountWear(uint32_t address, uint32_t size);
+    void LoadWear(void);
+    
+    /*
+     * A ring that's moving to less worn blocks. Poll() erases its new home and copies it across a page
+     * at a time, in the background while the ring carries on where it is, and switches the ring
+     * over once the copy catches up with the head.
+     */
+    uint16_t relocating = 0xffff; //store number, 0xffff if none
+    uint32_t relocateFrom = 0; //its start address, to spot it being deleted
+    uint32_t relocateTarget = 0;
+    uint32_t relocateEnd = 0; //NextFreeRegion() keeps [relocateTarget, relocateEnd) out of the free space
+    uint32_t relocateBase = 0; //the tailCount that lands at relocateTarget
+    uint32_t relocateCopied = 0; //count copied up to
+    uint32_t relocateErased = 0; //count the target is erased up to
+    uint8_t relocateErase = 0; //handle for the target's latest erase
+    
+    uint32_t RelocatedAddress(uint32_t count, uint32_t size) {return relocateTarget + (count - relocateBase) % size;}
+    
+    void RelocateRing(void); //starts moving currStore, if it's worth it
+    void StepRelocation(void);
+#endif
+
+#if FLASH_INSTRUMENTATION
+    LatencyHistogram mountLatency; //ReadStoresFromFlash()
+    uint32_t bytesAppended = 0;
+#endif
+
 public:
-    FlashStoreManager(Flash* fl) : flash(fl) {}
-    void Init(void) {} //might be useful someday?
+    FlashStoreManagerT(FlashType* fl) : flash(fl)
+    {
+        memset(slotIndex, NO_STORE, sizeof(slotIndex));
+#if FLASH_WEAR_LEVELING
+        memset(wear, 0, sizeof(wear));
+#endif
+    }
+    void Init(void) {ReadStoresFromFlash();} //mount
 
     uint32_t Select(uint16_t storeNumber);
 
     uint16_t ReadStoresFromFlash(void);
-    TListIterator<Datastore> GetStoresIterator(bool refresh)
+    DatastoreIterator GetStoresIterator(bool refresh)
     {
         if(refresh) ReadStoresFromFlash();
-        return TListIterator<Datastore>(storeList);
+        return DatastoreIterator(stores, byAddress, storeCount);
     }
     
-    uint32_t CreateStore(uint16_t fileNum, uint32_t sizeReq);
+    /*
+     * A ring store (at least three blocks) never fills: when the head moves into a new block, the block
+     * after it, which holds the oldest data, is erased in the background. Writes to a ring can't be
+     * bigger than a block; a DatastoreReader reads it oldest to newest.
+     */
+    uint32_t CreateStore(uint16_t fileNum, uint32_t sizeReq, bool ring = false);
+    void SetAllocPolicy(uint8_t policy) {allocPolicy = policy;}
+    
+    //returns the unallocated bytes; optionally the largest free extent and how many there are,
+    //so fragmentation can be tracked
+    uint32_t GetFreeSpace(uint32_t* largest = NULL, uint16_t* extents = NULL);
     uint32_t DeleteStore(uint16_t);
     
-    uint32_t Write(const BufferArray&);
+    /*
+     * Appends one record, all or nothing: 0 if it doesn't fit in what's left of the store. The
+     * segment version gathers a record from several places without copying it together.
+     */
+    uint32_t Write(const FlashSegment* segments, uint8_t count);
+    uint32_t Write(const uint8_t* data, uint32_t count)
+    {
+        FlashSegment segment = {data, count};
+        return Write(&segment, 1);
+    }
+    uint32_t Write(const BufferArray& buffer) {return Write(&buffer[0], buffer.GetSize());}
+    uint32_t Checkpoint(void); //records how far the current store is filled (FLASH_STORE_CHECKPOINTS; not rings)
+    uint32_t Flush(void) {return flash->Flush();} //commit anything the driver is holding back
+    
+    //moves background erases along (and saves the wear table when it's due); call from the main loop
+    uint8_t Poll(void)
+    {
+        uint8_t pending = 0;
+#if FLASH_WEAR_LEVELING
+        if(wearDirty >= FLASH_WEAR_SAVE_INTERVAL) SaveWear();
+        if(relocating != 0xffff) StepRelocation();
+        pending = relocating != 0xffff;
+#endif
+        if(deferredCount) StartDeferred();
+        return flash->Poll() + deferredCount + pending;
+    }
+
+#if FLASH_WEAR_LEVELING
+    bool SaveWear(void); //Poll() does this when it's due; worth calling before a planned power-down
+    uint16_t GetEraseCount(uint32_t address) {return Wear(address);} //for the block holding address
+    
+    //the spread of erase counts over the chip: returns the most, optionally the least and mean
+    uint16_t GetWearSpread(uint16_t* least = NULL, uint16_t* mean = NULL);
+    void DumpWear(Print& out);
+#endif
+    
+    //the manager's own numbers, then the chip's (FLASH_INSTRUMENTATION)
+#if FLASH_INSTRUMENTATION
+    void DumpStats(Print& out);
+    void ResetStats(void)
+    {
+        mountLatency = LatencyHistogram();
+        bytesAppended = 0;
+        flash->ResetStats();
+    }
+#else
+    void DumpStats(Print&) {}
+    void ResetStats(void) {}
+#endif
+    
+    template <class> friend class DatastoreReaderT;
+    template <class> friend class StoreQueueT;
+};
+
+typedef FlashStoreManagerT<> FlashStoreManager;
+
+/*
+ * Streams a store back out. Positions are offsets from the start of the store's data, and reads stop
+ * at the append cursor. Small reads are served from a buffer that's refilled one burst at a time;
+ * reads at least as big as the buffer go straight from the chip into the caller's memory, so dumping
+ * a whole store takes a handful of transactions. Several readers can be open on one manager.
+ *
+ * For a ring store, position 0 is the oldest byte when the reader was opened, and positions count
+ * every byte written since, however many times the ring has wrapped. Data the ring erases from under
+ * the reader is skipped. A remount starts a ring's count over, so reopen readers after one.
+ */
+template <class FlashType = Flash> class DatastoreReaderT
+{
+protected:
+    FlashStoreManagerT<FlashType>* manager = NULL;
+    uint16_t storeNumber = 0xffff;
+    uint32_t startAddress = 0; //first data byte, to spot the store being deleted and recreated
+    uint32_t origin = 0; //a ring's tailCount when opened: position 0
+    uint32_t position = 0;
+    
+    uint8_t chunk[FLASH_READER_CHUNK];
+    uint32_t chunkStart = 0; //store offset of chunk[0]
+    uint16_t chunkCount = 0;
+    
+    Datastore* GetStore(void);
+    uint32_t Dropped(Datastore* store); //positions a ring has erased since Open()
+    uint32_t ReadAt(Datastore* store, uint32_t offset, uint8_t* data, uint32_t count);
+
+public:
+    DatastoreReaderT(FlashStoreManagerT<FlashType>* m) : manager(m) {}
+    
+    bool Open(uint16_t number);
+    void Close(void) {storeNumber = 0xffff; chunkCount = 0;}
+    
+    uint32_t Read(uint8_t* data, uint32_t count); //returns bytes read; 0 at the end or if the store is gone
+    uint32_t Read(BufferArray& buffer) {return Read(&buffer[0], buffer.GetSize());}
+    
+    bool Seek(uint32_t offset); //false (and no move) if offset is past the data
+    uint32_t Tell(void) {return position;}
+    
+    uint32_t Size(void); //bytes written to the store so far
+    uint32_t Available(void) {return Size() - position;}
+};
+
+typedef DatastoreReaderT<> DatastoreReader;
+
+/*
+ * Lets interrupt handlers log to a store. Push() copies a record into a fixed ring buffer with no
+ * locks, allocation or SPI; Service(), called from the main loop, appends what's queued to the
+ * manager's current store a page at a time. There can be one producer (one ISR, or several that
+ * can't interrupt each other) and one consumer.
+ *
+ * A record goes in whole or not at all. Dropped records are counted, and the high-water mark shows
+ * how close the buffer has come to full, for sizing FLASH_QUEUE_SIZE.
+ */
+template <class FlashType = Flash> class StoreQueueT
+{
+protected:
+    FlashStoreManagerT<FlashType>* manager = NULL;
+    
+    uint8_t data[FLASH_QUEUE_SIZE];
+    volatile uint16_t head = 0; //free-running byte counts: Push() moves head, Service() moves tail
+    volatile uint16_t tail = 0;
+    
+    volatile uint16_t highWater = 0;
+    volatile uint32_t overflows = 0;
+    
+    uint16_t Head(void)
+    {
+        uint16_t h;
+        FLASH_QUEUE_ATOMIC {h = head;}
+        FLASH_QUEUE_BARRIER(); //read the data after head says it's there
+        return h;
+    }
+    
+    template <class T> T Load(volatile T& value)
+    {
+        T v;
+        FLASH_QUEUE_ATOMIC {v = value;}
+        return v;
+    }
+
+public:
+    StoreQueueT(FlashStoreManagerT<FlashType>* m) : manager(m) {}
+    
+    //safe in an ISR; false (and the record dropped) if there isn't room for all of it
+    bool Push(const void* record, uint16_t size)
+    {
+        uint16_t used = head - tail;
+        if(size > FLASH_QUEUE_SIZE - used)
+        {
+            overflows++;
+            return false;
+        }
+        FLASH_QUEUE_BARRIER(); //tail is read before the bytes Service() freed are written over
+        
+        const uint8_t* bytes = (const uint8_t*)record;
+        uint16_t at = head & (FLASH_QUEUE_SIZE - 1);
+        uint16_t first = FLASH_QUEUE_SIZE - at;
+        if(first > size) first = size;
+        memcpy(&data[at], bytes, first);
+        memcpy(data, bytes + first, size - first);
+        
+        used += size;
+        if(used > highWater) highWater = used;
+        
+        FLASH_QUEUE_BARRIER(); //the record lands before head moves past it
+        head += size;
+        return true;
+    }
+    
+    /*
+     * Appends whole pages of queued data to the current store; with all set, whatever's left too
+     * (then Flush() the manager to get it onto the chip). Returns bytes written. If the store is
+     * full or none is selected, the data stays queued and later records overflow.
+     */
+    uint32_t Service(bool all = false);
+    
+    uint16_t GetQueued(void) {return Head() - tail;}
+    uint16_t GetHighWater(void) {return Load(highWater);}
+    uint32_t GetOverflows(void) {return Load(overflows);} //records dropped
+    void ResetStats(void) {FLASH_QUEUE_ATOMIC {highWater = GetQueued(); overflows = 0;}}
 };
 
+typedef StoreQueueT<> StoreQueue;
+
 #endif /* dataflash_h */
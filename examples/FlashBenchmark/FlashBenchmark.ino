@@ -0,0 +1,183 @@
+//
+//  FlashBenchmark.ino
+//  flash
+//
+//  Times the operations that matter for logging on each chip it finds and prints one CSV
+//  line per result, so runs can be compared from one library version to the next.
+//  Runs on hardware, or on Linux against the simulated chips through host/FlashBenchmark.cpp.
+//  Define AT25_CS2 for a board with a second AT25DF641A, and the two are also tested striped.
+//
+//  It ERASES the chips it tests.
+//
+
+#include <SPI.h>
+#include <dataflash.h>
+
+#ifndef AT25_CS
+#define AT25_CS 10
+#endif
+
+#ifndef AT45_CS
+#define AT45_CS 11
+#endif
+
+#define APPEND_BYTES    65536ul //appended per record size
+#define RANDOM_READS    500
+#define BENCH_STORES    32
+#define BENCH_STORE_SIZE 16384ul
+
+FlashAT25DF641A at25(&SPI, AT25_CS);
+FlashAT45DB321E at45(&SPI, AT45_CS);
+
+FlashStoreManager at25Stores(&at25);
+FlashStoreManager at45Stores(&at45);
+
+#ifdef AT25_CS2
+FlashAT25DF641A at25b(&SPI, AT25_CS2);
+Flash* const at25Pair[] = {&at25, &at25b};
+FlashArray striped(at25Pair, 2, FLASH_STRIPE);
+FlashStoreManager stripedStores(&striped);
+#endif
+
+//xorshift, so every platform reads the same addresses
+uint32_t seed = 2463534242ul;
+
+uint32_t Random(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    
+    return seed;
+}
+
+void Report(const char* chip, const char* test, uint32_t size, uint32_t count, uint32_t bytes, uint32_t us)
+{
+    Serial.print(chip);
+    Serial.print(',');
+    Serial.print(test);
+    Serial.print(',');
+    Serial.print(size);
+    Serial.print(',');
+    Serial.print(count);
+    Serial.print(',');
+    Serial.print(bytes);
+    Serial.print(',');
+    Serial.print(us);
+    Serial.print(',');
+    Serial.print(count ? (double)us / count : 0.0, 1);
+    Serial.print(',');
+    Serial.println(us ? bytes * 1000.0 / us : 0.0, 1); //bytes per ms = kB/s
+}
+
+void WaitForErases(FlashStoreManager& stores)
+{
+    while(stores.Poll()) {}
+}
+
+void RunBenchmarks(Flash& flash, FlashStoreManager& stores, const char* chip)
+{
+    uint32_t start = micros();
+    uint32_t erased = flash.Erase(0, flash.GetByteCount());
+    Report(chip, "chip_erase", flash.GetByteCount(), 1, erased, micros() - start);
+    
+    start = micros();
+    stores.Init();
+    Report(chip, "mount_empty", 0, 1, 0, micros() - start);
+    
+    //create/delete: the call itself, then until the background erase is done
+    uint32_t callUs = 0;
+    start = micros();
+    for(uint16_t i = 0; i < BENCH_STORES; i++)
+    {
+        uint32_t t = micros();
+        stores.CreateStore(i, BENCH_STORE_SIZE);
+        callUs += micros() - t;
+    }
+    
+    Report(chip, "create_call", BENCH_STORE_SIZE, BENCH_STORES, 0, callUs);
+    WaitForErases(stores);
+    Report(chip, "create_done", BENCH_STORE_SIZE, BENCH_STORES, 0, micros() - start);
+    
+    callUs = 0;
+    start = micros();
+    for(uint16_t i = 0; i < BENCH_STORES; i += 2)
+    {
+        uint32_t t = micros();
+        stores.DeleteStore(i);
+        callUs += micros() - t;
+    }
+    
+    Report(chip, "delete_call", BENCH_STORE_SIZE, BENCH_STORES / 2, 0, callUs);
+    WaitForErases(stores);
+    Report(chip, "delete_done", BENCH_STORE_SIZE, BENCH_STORES / 2, 0, micros() - start);
+    
+    //appends, one store per record size
+    static const uint16_t recordSizes[] = {16, 64, 256, 1024};
+    for(uint8_t r = 0; r < sizeof(recordSizes) / sizeof(recordSizes[0]); r++)
+    {
+        uint16_t storeNumber = 100 + r;
+        if(!stores.CreateStore(storeNumber, APPEND_BYTES)) continue;
+        WaitForErases(stores);
+        stores.Select(storeNumber);
+        
+        BufferArray record(recordSizes[r]);
+        for(uint16_t i = 0; i < recordSizes[r]; i++) record[i] = Random();
+        
+        uint32_t records = APPEND_BYTES / recordSizes[r];
+        uint32_t bytes = 0;
+        start = micros();
+        for(uint32_t i = 0; i < records; i++) bytes += stores.Write(record);
+        stores.Flush();
+        
+        Report(chip, "append", recordSizes[r], records, bytes, micros() - start);
+    }
+    
+    //random reads anywhere on the chip
+    static const uint16_t readSizes[] = {16, 256};
+    uint8_t buffer[256];
+    for(uint8_t r = 0; r < sizeof(readSizes) / sizeof(readSizes[0]); r++)
+    {
+        uint32_t bytes = 0;
+        start = micros();
+        for(uint16_t i = 0; i < RANDOM_READS; i++)
+        {
+            uint32_t address = Random() % (flash.GetByteCount() - readSizes[r]);
+            bytes += flash.ReadBytes(address, buffer, readSizes[r]);
+        }
+        
+        Report(chip, "random_read", readSizes[r], RANDOM_READS, bytes, micros() - start);
+    }
+    
+    //mount with stores in place and data to find the end of
+    start = micros();
+    uint16_t count = stores.ReadStoresFromFlash();
+    Report(chip, "mount", count, 1, 0, micros() - start);
+}
+
+void setup()
+{
+    Serial.begin(115200);
+    while(!Serial) {}
+    
+    Serial.println(F("chip,test,size,count,bytes,us,us_per_op,kB_per_s"));
+    
+    //only chips that answer with Adesto's ID get tested
+    at25.Init();
+    if(at25.GetIDdata().manufacturerID == 0x1F) RunBenchmarks(at25, at25Stores, "AT25DF641A");
+    
+    at45.Init();
+    if(at45.GetIDdata().manufacturerID == 0x1F) RunBenchmarks(at45, at45Stores, "AT45DB321E");
+    
+#ifdef AT25_CS2
+    at25b.Init();
+    striped.Init();
+    if(at25.GetIDdata().manufacturerID == 0x1F && striped.GetByteCount()) RunBenchmarks(striped, stripedStores, "AT25DF641Ax2");
+#endif
+    
+    Serial.println(F("done"));
+}
+
+void loop()
+{
+}
@@ -0,0 +1,474 @@
+//
+//  flash.cpp
+//  flash
+//
+//  Chip-independent parts of Flash: the erase queue and the access guard around it.
+//
+
+#include "flash.h"
+
+uint32_t Flash::ReadBytes(uint32_t address, uint8_t* data, uint32_t count)
+{
+    if(address >= byteCount) return 0; //basic check for address range
+    if(count > byteCount - address) count = byteCount - address; //don't run off the end of the chip
+    
+    FLASH_STAT(uint32_t startUs = micros());
+
+#if FLASH_READ_CACHE_BYTES
+    //big reads go straight through rather than flushing the cache, as does everything if a page won't fit
+    if(bytesPerPage && bytesPerPage <= FLASH_READ_CACHE_BYTES && count <= FLASH_READ_CACHE_BYTES / 2) count = CachedRead(address, data, count);
+    else
+#endif
+    if(BeginRead(address, count))
+    {
+        ReceiveBytes(data, count);
+        EndRead();
+    }
+    else count = 0;
+    
+    FLASH_STAT(stats.read.Add(micros() - startUs));
+    
+    return count;
+}
+
+uint32_t Flash::Write(uint32_t address, const FlashSegment* segments, uint8_t count)
+{
+    uint32_t written = 0;
+    for(uint8_t i = 0; i < count; i++)
+    {
+        if(!segments[i].size) continue;
+        
+        uint32_t n = Write(address + written, segments[i].data, segments[i].size);
+        written += n;
+        if(n != segments[i].size) break;
+    }
+    
+    return written;
+}
+
+#if FLASH_READ_CACHE_BYTES
+#define NO_PAGE 0xffffffff
+
+int16_t Flash::CacheFind(uint32_t page)
+{
+    uint16_t lines = FLASH_READ_CACHE_BYTES / bytesPerPage;
+    for(uint16_t i = 0; i < lines; i++)
+    {
+        if(cachePage[i] == page) return i;
+    }
+    
+    return -1;
+}
+
+/*
+ * reads pages into the cache in one transaction and returns the line holding the first
+ */
+int16_t Flash::CacheFetch(uint32_t page, uint16_t pages)
+{
+    if(pages > (byteCount - page) / bytesPerPage) pages = (byteCount - page) / bytesPerPage;
+    if(!BeginRead(page, pages * bytesPerPage)) return -1;
+    
+    uint16_t lines = FLASH_READ_CACHE_BYTES / bytesPerPage;
+    int16_t first = -1;
+    for(uint16_t p = 0; p < pages; p++, page += bytesPerPage)
+    {
+        int16_t line = CacheFind(page);
+        if(line < 0)
+        {
+            line = 0;
+            for(uint16_t i = 1; i < lines; i++)
+            {
+                if(cacheUsed[i] < cacheUsed[line]) line = i;
+            }
+        }
+        
+        ReceiveBytes(cacheData + line * bytesPerPage, bytesPerPage);
+        cachePage[line] = page;
+        cacheUsed[line] = ++cacheStamp;
+        
+        if(first < 0) first = line;
+    }
+    
+    EndRead();
+    
+    nextPage = page;
+    
+    return first;
+}
+
+uint32_t Flash::CachedRead(uint32_t address, uint8_t* data, uint32_t count)
+{
+    uint16_t lines = FLASH_READ_CACHE_BYTES / bytesPerPage;
+    
+    uint32_t done = 0;
+    while(done < count)
+    {
+        uint32_t page = (address + done) & ~(uint32_t)(bytesPerPage - 1);
+        
+        int16_t line = CacheFind(page);
+        if(line < 0)
+        {
+            cacheMisses++;
+            
+            uint16_t pages = page == nextPage && lines > 1 ? lines / 2 : 1; //read ahead if sequential
+            line = CacheFetch(page, pages);
+            if(line < 0) return done; //being erased
+        }
+        else cacheHits++;
+        
+        cacheUsed[line] = ++cacheStamp;
+        
+        uint16_t offset = address + done - page;
+        uint32_t n = bytesPerPage - offset;
+        if(n > count - done) n = count - done;
+        
+        memcpy(data + done, cacheData + line * bytesPerPage + offset, n);
+        done += n;
+    }
+    
+    return done;
+}
+
+void Flash::InvalidateCache(uint32_t address, uint32_t count)
+{
+    for(uint16_t i = 0; i < FLASH_READ_CACHE_BYTES / FLASH_MIN_PAGE; i++)
+    {
+        //any line that overlaps [address, address + count)
+        if(cachePage[i] == NO_PAGE || cachePage[i] + bytesPerPage <= address) continue;
+        if(cachePage[i] < address || cachePage[i] - address < count)
+        {
+            cachePage[i] = NO_PAGE;
+            cacheUsed[i] = 0;
+        }
+    }
+}
+
+void Flash::ClearCache(void)
+{
+    for(uint16_t i = 0; i < FLASH_READ_CACHE_BYTES / FLASH_MIN_PAGE; i++)
+    {
+        cachePage[i] = NO_PAGE;
+        cacheUsed[i] = 0;
+    }
+}
+#endif
+
+uint32_t Flash::PageChecksum(uint32_t address)
+{
+    if(!BeginRead(address, bytesPerPage)) return 0;
+    
+    uint32_t sum = 0;
+    uint8_t chunk[32];
+    for(uint16_t i = 0; i < bytesPerPage; i += sizeof(chunk))
+    {
+        ReceiveBytes(chunk, sizeof(chunk));
+        for(uint8_t j = 0; j < sizeof(chunk); j++) sum = sum * 31 + chunk[j];
+    }
+    
+    EndRead();
+    
+    return sum;
+}
+
+uint32_t Flash::TuneClock(uint32_t maxHz, uint32_t checkAddress)
+{
+    uint32_t original = clockHz;
+    
+    //what the chip says when there's no doubt
+    SetClock(FLASH_SPI_CLOCK_MIN);
+    IDdata id = ReadIDdata();
+    if(id.manufacturerID == 0x00 || id.manufacturerID == 0xff) //nobody home
+    {
+        SetClock(original);
+        return 0;
+    }
+    
+    uint32_t sum = PageChecksum(checkAddress);
+    
+    uint32_t below = FLASH_SPI_CLOCK_MIN; //the step before the last one that passed
+    uint32_t passed = FLASH_SPI_CLOCK_MIN;
+    bool failed = false;
+    while(passed < maxHz && !failed)
+    {
+        uint32_t hz = passed + passed / 2;
+        if(hz > maxHz) hz = maxHz;
+        SetClock(hz);
+        
+        //a marginal clock doesn't fail every time, so try a few
+        for(uint8_t i = 0; i < 4 && !failed; i++)
+        {
+            IDdata check = ReadIDdata();
+            failed = check.manufacturerID != id.manufacturerID || check.deviceID1 != id.deviceID1
+                || check.deviceID2 != id.deviceID2 || PageChecksum(checkAddress) != sum;
+        }
+        
+        if(!failed)
+        {
+            below = passed;
+            passed = hz;
+        }
+    }
+    
+    SetClock(failed ? below : passed); //if it never failed, maxHz is the limit, not the wiring
+    
+    return clockHz;
+}
+
+const EraseOp* Flash::PlanStep(uint32_t address, uint32_t size)
+{
+    for(uint8_t i = 0; i < eraseOpCount; i++)
+    {
+        const EraseOp& op = eraseOps[i];
+        if(op.size <= size && !(address & (op.size - 1)) && address >= op.minAddress) return &op;
+    }
+    
+    return NULL;
+}
+
+uint32_t Flash::PlanErase(uint32_t addr, uint32_t size, uint16_t* commands)
+{
+    uint32_t ms = 0;
+    uint16_t count = 0;
+    
+    while(size)
+    {
+        const EraseOp* op = PlanStep(addr, size);
+        if(!op) return 0; //unaligned start or leftover smaller than the smallest erase
+        
+        ms += op->typicalMs;
+        count++;
+        
+        addr += op->size;
+        size -= op->size;
+    }
+    
+    if(commands) *commands = count;
+    
+    return ms;
+}
+
+uint32_t Flash::IssueErase(uint32_t address, uint32_t size)
+{
+    const EraseOp* op = PlanStep(address, size);
+    if(!op) return 0;
+    
+    return SendErase(address, op->cmd) ? op->size : 0;
+}
+
+uint8_t Flash::StartErase(uint32_t addr, uint32_t size, EraseCallback callback)
+{
+    if(!size || addr >= byteCount || size > byteCount - addr) return 0;
+    if(!PlanErase(addr, size)) return 0;
+    
+    if(eraseJobs == FLASH_ERASE_QUEUE) return ExtendErase(addr, size, callback);
+    
+    Flush(); //anything held back lands before the erase, as it was written before it
+    InvalidateCache(addr, size);
+    
+    if(++lastHandle == 0) lastHandle = 1; //0 means 'no handle'
+    
+    EraseJob& job = eraseQueue[eraseJobs++];
+    job.handle = lastHandle;
+    job.startAddress = addr;
+    job.nextAddress = addr;
+    job.endAddress = addr + size;
+    job.callback = callback;
+    
+    return job.handle;
+}
+
+/*
+ * With the queue full, a range that runs on from a job (or, for one that hasn't started, leads into
+ * it) joins that job, so it can also go out in bigger commands. It shares the job's handle.
+ */
+uint8_t Flash::ExtendErase(uint32_t addr, uint32_t size, EraseCallback callback)
+{
+    if(callback) return 0; //each callback is owed its own handle
+    
+    for(uint8_t i = 0; i < eraseJobs; i++)
+    {
+        EraseJob& job = eraseQueue[i];
+        if(job.callback) continue;
+        
+        bool after = job.endAddress == addr;
+        bool before = addr + size == job.startAddress && job.nextAddress == job.startAddress;
+        if(!after && !before) continue;
+        
+        Flush();
+        InvalidateCache(addr, size);
+        
+        if(after) job.endAddress += size;
+        else job.startAddress = job.nextAddress = addr;
+        
+        return job.handle;
+    }
+    
+    return 0;
+}
+
+uint8_t Flash::Poll(void)
+{
+    //never interrupt a read or program that has the erase suspended
+    if(!eraseJobs || accessDepth) return eraseJobs;
+    
+    //the current command (or somebody's page program) is still going
+    if(IsBusy()) return eraseJobs;
+    
+    FLASH_STAT(if(eraseIssued) stats.erase.Add(micros() - eraseIssuedUs));
+    eraseIssued = false;
+    
+    EraseJob& job = eraseQueue[0];
+    if(job.nextAddress >= job.endAddress)
+    {
+        EraseJob done = job;
+        
+        eraseJobs--;
+        for(uint8_t i = 0; i < eraseJobs; i++) eraseQueue[i] = eraseQueue[i + 1];
+        
+        //called after the job is off the queue, so the callback is free to queue more
+        if(done.callback) done.callback(done.handle);
+        
+        //start the next job now rather than waiting for the next Poll()
+        return Poll();
+    }
+    
+    uint32_t covered = IssueErase(job.nextAddress, job.endAddress - job.nextAddress);
+    if(covered)
+    {
+        job.nextAddress += covered;
+        eraseIssued = true;
+        FLASH_STAT(eraseIssuedUs = micros());
+    }
+    else job.nextAddress = job.endAddress; //driver refused; drop the rest of the job
+    
+    return eraseJobs;
+}
+
+bool Flash::IsErasePending(uint8_t handle)
+{
+    for(uint8_t i = 0; i < eraseJobs; i++)
+    {
+        if(eraseQueue[i].handle == handle) return true;
+    }
+    
+    return false;
+}
+
+uint32_t Flash::Erase(uint32_t addr, uint32_t size)
+{
+    uint8_t handle = StartErase(addr, size);
+    while(!handle && eraseJobs) //queue is full: make room
+    {
+        Poll();
+        handle = StartErase(addr, size);
+    }
+    
+    if(!handle) return 0;
+    
+    while(IsErasePending(handle)) Poll();
+    
+    return size;
+}
+
+bool Flash::IsQueuedForErase(uint32_t address, uint32_t count)
+{
+    //the whole of a queued job is off limits until it's done, even the parts already erased
+    for(uint8_t i = 0; i < eraseJobs; i++)
+    {
+        if(address < eraseQueue[i].endAddress && eraseQueue[i].startAddress < address + count) return true;
+    }
+    
+    return false;
+}
+
+uint8_t Flash::BeginAccess(uint32_t address, uint32_t count)
+{
+    if(IsQueuedForErase(address, count)) return 0;
+    
+    if(accessDepth++) return 1; //already cleared for this access
+    
+    if(eraseIssued && IsBusy())
+    {
+        SuspendErase();
+        WaitWhileBusy(); //suspend takes effect in tens of us
+        
+        eraseSuspended = true;
+    }
+    else if(eraseIssued)
+    {
+        //it's finished: the next time the chip is busy it'll be with our own program, which can't be suspended
+        FLASH_STAT(stats.erase.Add(micros() - eraseIssuedUs));
+        eraseIssued = false;
+    }
+    
+    return 1;
+}
+
+void Flash::EndAccess(void)
+{
+    if(--accessDepth) return;
+    
+    if(eraseSuspended)
+    {
+        WaitWhileBusy(); //anything programmed during the suspend has to finish first
+        ResumeErase();
+        
+        eraseSuspended = false;
+    }
+}
+
+#if FLASH_INSTRUMENTATION
+void LatencyHistogram::Dump(Print& out, const char* name)
+{
+    out.print(name);
+    out.print(F(" count "));
+    out.print(count);
+    out.print(F(" total_us "));
+    out.print(totalUs);
+    out.print(F(" max_us "));
+    out.print(maxUs);
+    out.print(F(" bins"));
+    
+    //bin k holds [2^(k-1), 2^k) us; trailing empty bins are left off
+    uint8_t last = FLASH_HISTOGRAM_BINS;
+    while(last && !bins[last - 1]) last--;
+    for(uint8_t i = 0; i < last; i++)
+    {
+        out.print(' ');
+        out.print(bins[i]);
+    }
+    
+    out.println();
+}
+
+/*
+ * one 'name value...' line per item, easy to pick apart on the other end of the serial port
+ */
+void Flash::DumpStats(Print& out)
+{
+    out.print(F("bytes_read "));
+    out.println(stats.bytesRead);
+    out.print(F("bytes_programmed "));
+    out.println(stats.bytesProgrammed);
+    out.print(F("page_programs "));
+    out.println(stats.programs);
+    
+    for(uint8_t i = 0; i < eraseOpCount && i < FLASH_MAX_ERASE_OPS; i++)
+    {
+        out.print(F("erases_"));
+        out.print(eraseOps[i].size);
+        out.print(' ');
+        out.println(stats.erases[i]);
+    }
+    
+    out.print(F("busy_waits "));
+    out.println(stats.busyWaits);
+    out.print(F("busy_us "));
+    out.println(stats.busyUs);
+    
+    stats.read.Dump(out, "read_latency");
+    stats.write.Dump(out, "write_latency");
+    stats.program.Dump(out, "program_latency");
+    stats.erase.Dump(out, "erase_latency");
+}
+#endif
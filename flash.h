@@ -16,6 +16,71 @@
 
 #define BufferArray TArray<uint8_t> //basic structure for reading and writing
 
+#if defined(TEENSYDUINO) && !defined(FLASH_SPI_TXRX_BUFFER)
+#define FLASH_SPI_TXRX_BUFFER //Teensy cores do separate tx/rx buffer transfers
+#endif
+
+#ifndef FLASH_SPI_CHUNK
+#define FLASH_SPI_CHUNK 64 //stack staging for bulk writes when the core only has in-place transfer()
+#endif
+
+#ifndef FLASH_SPI_CLOCK
+#define FLASH_SPI_CLOCK 12000000 //until SetClock() or TuneClock() says otherwise (DIV4 on a SAMD21)
+#endif
+
+#ifndef FLASH_SPI_CLOCK_MIN
+#define FLASH_SPI_CLOCK_MIN 1000000 //where TuneClock() starts; anything should manage this
+#endif
+
+#ifndef FLASH_ERASE_QUEUE
+#define FLASH_ERASE_QUEUE 8 //number of erases that can be queued at once
+#endif
+
+#ifndef FLASH_READ_CACHE_BYTES
+#define FLASH_READ_CACHE_BYTES 0 //RAM for the ReadBytes() page cache, used in whole pages; 0 leaves it out
+#endif
+
+//page sizes of the supported chips (AT25DF641A, AT45DB321E binary pages): the cache is split into lines by them
+#define FLASH_MIN_PAGE 256
+#define FLASH_MAX_PAGE 512
+
+#if FLASH_READ_CACHE_BYTES % FLASH_MAX_PAGE
+#error "FLASH_READ_CACHE_BYTES has to be a multiple of the largest page (512 bytes)"
+#endif
+
+#ifndef FLASH_INSTRUMENTATION
+#define FLASH_INSTRUMENTATION 0 //1 compiles in the counters and latency histograms (see FlashStats)
+#endif
+
+#if FLASH_INSTRUMENTATION
+#define FLASH_STAT(x) x
+#else
+#define FLASH_STAT(x)
+#endif
+
+#ifndef FLASH_HISTOGRAM_BINS
+#define FLASH_HISTOGRAM_BINS 24 //the last bin starts at ~4 s
+#endif
+
+#define FLASH_MAX_ERASE_OPS 4 //entries in a driver's erase table
+
+#ifndef FLASH_ARRAY_CHIPS
+#define FLASH_ARRAY_CHIPS 4 //most chips a FlashArray can hold
+#endif
+
+#if FLASH_ARRAY_CHIPS > 8
+#error "a FlashArray keeps one bit per chip in a byte: 8 chips at most"
+#endif
+
+//how a FlashArray lays its chips out
+#define FLASH_CONCAT 0 //one after another
+#define FLASH_STRIPE 1 //page by page, round the chips in turn
+
+//read modes for chips with wide reads
+#define FLASH_READ_SINGLE   0
+#define FLASH_READ_DUAL     1
+#define FLASH_READ_AUTO     2 //dual if a transport is supplied and checks out at Init(), otherwise single
+
 struct IDdata
 {
     uint8_t manufacturerID = 0;
@@ -26,11 +91,129 @@ struct IDdata
     //should really read the extended data, but we'll leave blank for now...
 };
 
+/*
+ * One piece of a gathered write (like an iovec), so a header, payload and CRC kept in separate
+ * places go out as one record without being copied together first.
+ */
+struct FlashSegment
+{
+    const uint8_t* data;
+    uint32_t size;
+};
+
+/*
+ * One erase command a chip offers. Drivers list theirs largest first.
+ */
+struct EraseOp
+{
+    uint32_t size;
+    uint8_t cmd;
+    uint16_t typicalMs; //datasheet typical, for planning
+    uint32_t minAddress; //some chips can't use this size near the bottom of memory
+};
+
+/*
+ * Latencies in power-of-two bins of microseconds: bin 0 is under 1 us, bin k is [2^(k-1), 2^k) us,
+ * and the last bin takes everything longer. Adding one is a handful of instructions.
+ */
+struct LatencyHistogram
+{
+    uint32_t bins[FLASH_HISTOGRAM_BINS] = {0};
+    uint32_t count = 0;
+    uint32_t totalUs = 0;
+    uint32_t maxUs = 0;
+    
+    void Add(uint32_t us)
+    {
+        //long is 32 bits at least (int can be 16, as on AVR)
+        uint8_t bin = us ? 8 * sizeof(unsigned long) - __builtin_clzl(us) : 0;
+        bins[bin < FLASH_HISTOGRAM_BINS ? bin : FLASH_HISTOGRAM_BINS - 1]++;
+        
+        count++;
+        totalUs += us;
+        if(us > maxUs) maxUs = us;
+    }
+    
+    void Dump(Print& out, const char* name);
+};
+
+/*
+ * What FLASH_INSTRUMENTATION collects on each Flash. Erases are counted per entry in the driver's
+ * erase table (largest first), whether they came from the queue or from EraseBlock().
+ */
+struct FlashStats
+{
+    uint32_t bytesRead = 0;
+    uint32_t bytesProgrammed = 0;
+    uint32_t programs = 0; //page programs
+    uint32_t erases[FLASH_MAX_ERASE_OPS] = {0};
+    
+    uint32_t busyWaits = 0; //waits that found the chip busy
+    uint32_t busyUs = 0; //time spent spinning in them
+    
+    //time in the call, which for programs isn't the chip's program time (that overlaps what comes next)
+    LatencyHistogram read; //ReadBytes()
+    LatencyHistogram write; //Write()
+    LatencyHistogram program; //one page program: WritePage(), or committing an SRAM buffer
+    LatencyHistogram erase; //blocking erases; queued ones from issue to the Poll() that sees them done
+};
+
+typedef void (*EraseCallback)(uint8_t handle);
+
+/*
+ * Clocks count bytes in over a transport the SPI library can't drive, such as two data lines.
+ * It's called with chip select already low and the command, address and dummy bytes sent.
+ */
+typedef void (*ReceiveHook)(uint8_t* data, uint32_t count);
+
+/*
+ * One queued call to StartErase(). Jobs are worked off in order, one chip command at a time.
+ */
+struct EraseJob
+{
+    uint8_t handle = 0;
+    uint32_t startAddress = 0;
+    uint32_t nextAddress = 0; //first byte that hasn't had a command issued yet
+    uint32_t endAddress = 0; //last byte + 1
+    EraseCallback callback = NULL;
+};
+
 class Flash
 {
 protected:
     SPIClass* spi = NULL;
     uint8_t chipSelect = -1;
+    bool selected = false;
+    
+    //this device's bus settings; every transaction applies them, so other devices can keep theirs
+    uint32_t clockHz = FLASH_SPI_CLOCK;
+    SPISettings spiSettings = SPISettings(FLASH_SPI_CLOCK, MSBFIRST, SPI_MODE0);
+    
+    uint32_t PageChecksum(uint32_t address);
+
+#if FLASH_INSTRUMENTATION
+    FlashStats stats;
+    uint32_t eraseIssuedUs = 0;
+    
+    void CountErase(uint8_t cmd)
+    {
+        for(uint8_t i = 0; i < eraseOpCount && i < FLASH_MAX_ERASE_OPS; i++)
+        {
+            if(eraseOps[i].cmd == cmd) stats.erases[i]++;
+        }
+    }
+#endif
+    
+    //the geometry comes from the ID, so drivers read it at a clock that can't be too fast
+    IDdata ReadIDdataSafely(void)
+    {
+        uint32_t clock = clockHz;
+        SetClock(FLASH_SPI_CLOCK_MIN);
+        IDdata id = ReadIDdata();
+        SetClock(clock);
+        
+        return id;
+    }
     
     //number of pages and number of total bytes
     //uint16_t totalPages = 0;
@@ -39,42 +222,306 @@ protected:
     uint16_t bytesPerBlock = 0;
     
     IDdata idData;
+    
+    ReceiveHook receiveHook = NULL; //set by BeginRead() when the data comes back on a wider transport
+    
+    //non-blocking erase engine; eraseQueue[0] is the job being worked on
+    EraseJob eraseQueue[FLASH_ERASE_QUEUE];
+    uint8_t eraseJobs = 0;
+    uint8_t lastHandle = 0;
+    bool eraseIssued = false; //a command for eraseQueue[0] is running on the chip
+    bool eraseSuspended = false;
+    uint8_t accessDepth = 0;
+    
+    //erase commands the chip offers, largest first; set by the driver's Init()
+    const EraseOp* eraseOps = NULL;
+    uint8_t eraseOpCount = 0;
+    
+    const EraseOp* PlanStep(uint32_t address, uint32_t size);
+    uint32_t IssueErase(uint32_t address, uint32_t size); //start one command, return the bytes it covers
+    uint8_t ExtendErase(uint32_t addr, uint32_t size, EraseCallback callback); //joins a queued job, or returns 0
+    
+    //drivers supply these for the erase engine
+    virtual uint8_t SendErase(uint32_t, uint8_t) {return 0;} //issue a command, don't wait
+    virtual void SuspendErase(void) {}
+    virtual void ResumeErase(void) {}
+    
+    /*
+     * Every read or program brackets itself with these. BeginAccess() refuses (returns 0)
+     * if the region is queued for or being erased; otherwise it suspends a running erase
+     * so the access can go ahead, and EndAccess() resumes it.
+     */
+    uint8_t BeginAccess(uint32_t address, uint32_t count);
+    void EndAccess(void);
+    bool IsQueuedForErase(uint32_t address, uint32_t count);
+
+#if FLASH_READ_CACHE_BYTES
+    /*
+     * LRU page cache in front of ReadBytes(). Lines are one chip page each, so the cache holds
+     * FLASH_READ_CACHE_BYTES / bytesPerPage of them. A miss on the page after the last one
+     * fetched is taken as a sequential read and brings in half the cache in one transaction.
+     */
+    uint8_t cacheData[FLASH_READ_CACHE_BYTES];
+    uint32_t cachePage[FLASH_READ_CACHE_BYTES / FLASH_MIN_PAGE]; //flash address of each line, NO_PAGE if empty
+    uint32_t cacheUsed[FLASH_READ_CACHE_BYTES / FLASH_MIN_PAGE]; //stamp of last use, oldest gets evicted
+    uint32_t cacheStamp = 0;
+    uint32_t nextPage = 0; //page after the last fetch
+    
+    uint32_t cacheHits = 0;
+    uint32_t cacheMisses = 0;
+    
+    int16_t CacheFind(uint32_t page);
+    int16_t CacheFetch(uint32_t page, uint16_t pages);
+    uint32_t CachedRead(uint32_t address, uint8_t* data, uint32_t count);
+    void InvalidateCache(uint32_t address, uint32_t count);
+#else
+    void InvalidateCache(uint32_t, uint32_t) {}
+#endif
 
 public:
-    Flash(void) {}
-    Flash(SPIClass* _spi, uint8_t cs) : spi(_spi), chipSelect(cs) {}
+    Flash(void) {ClearCache();}
+    Flash(SPIClass* _spi, uint8_t cs) : spi(_spi), chipSelect(cs) {ClearCache();}
     
     void Init(void)
     {
         pinMode(chipSelect, OUTPUT);        
         Deselect();
         
-        //this might not play well with others...
-        spi->setDataMode(SPI_MODE0);
-        spi->setBitOrder(MSBFIRST);
-        spi->setClockDivider(SPI_CLOCK_DIV4); //SAMD21 is too fast? or maybe I need better wiring
-        
-        spi->begin();
+        spi->begin(); //clock, mode and bit order go with each transaction
     }
 
-    void Select(void) { digitalWrite(chipSelect, LOW); }
-    void Deselect(void) { digitalWrite(chipSelect, HIGH); }
+    //each select is a transaction, so don't nest them
+    void Select(void)
+    {
+        spi->beginTransaction(spiSettings);
+        digitalWrite(chipSelect, LOW);
+        selected = true;
+    }
+    
+    void Deselect(void)
+    {
+        digitalWrite(chipSelect, HIGH);
+        if(selected) spi->endTransaction();
+        selected = false;
+    }
+    
+    void SetClock(uint32_t hz)
+    {
+        clockHz = hz;
+        spiSettings = SPISettings(hz, MSBFIRST, SPI_MODE0);
+    }
+    
+    uint32_t GetClock(void) {return clockHz;}
+    
+    uint32_t GetByteCount(void) {return byteCount;}
+    uint16_t GetPageSize(void) {return bytesPerPage;}
+    uint16_t GetBlockSize(void) {return bytesPerBlock;}
+    IDdata GetIDdata(void) {return idData;}
+    
+    /*
+     * Finds out how fast the wiring will go. Starting from FLASH_SPI_CLOCK_MIN, the clock steps up by
+     * half at a time towards maxHz for as long as the JEDEC ID and a checksum of the page at checkAddress
+     * (pick one that won't change, e.g. the FAT) read back the same as they did at the bottom. If a step
+     * fails, it settles one step below the last one that passed, for margin. Returns the clock it kept,
+     * or 0 (and leaves the clock alone) if there's no chip answering. Call after Init().
+     */
+    uint32_t TuneClock(uint32_t maxHz, uint32_t checkAddress = 0);
+    virtual IDdata ReadIDdata(void) {return idData;}
     
     void SendCommand(uint8_t cmd)
     {
         spi->transfer(cmd);
     }
     
-    virtual uint32_t Write(uint32_t, const BufferArray&); //= 0;
+    /*
+     * Bulk transfers: move a whole run of bytes in one call to the SPI layer instead of
+     * one transfer() per byte. Cores that can do a separate tx/rx buffer transfer (usually
+     * DMA- or FIFO-backed) get that; everyone else gets the in-place buffer transfer.
+     *
+     * Define FLASH_SPI_TXRX_BUFFER if your core provides transfer(const void*, void*, size_t).
+     */
+    virtual void ReceiveBytes(uint8_t* data, uint32_t count)
+    {
+        FLASH_STAT(stats.bytesRead += count);
+        
+        if(receiveHook)
+        {
+            receiveHook(data, count);
+            return;
+        }
+
+#if defined(ARDUINO_ARCH_ESP32)
+        spi->transferBytes(NULL, data, count);
+#elif defined(FLASH_SPI_TXRX_BUFFER)
+        spi->transfer(NULL, data, count);
+#else
+        memset(data, 0, count); //transfer() is in place, so we clock out zeros
+        spi->transfer(data, count);
+#endif
+    }
+    
+    void TransmitBytes(const uint8_t* data, uint32_t count)
+    {
+#if defined(ARDUINO_ARCH_ESP32)
+        spi->writeBytes(data, count);
+#elif defined(FLASH_SPI_TXRX_BUFFER)
+        spi->transfer(data, NULL, count);
+#else
+        //in-place transfer would clobber the caller's data, so go through a small staging buffer
+        uint8_t chunk[FLASH_SPI_CHUNK];
+        while(count)
+        {
+            uint16_t n = count < FLASH_SPI_CHUNK ? count : FLASH_SPI_CHUNK;
+            memcpy(chunk, data, n);
+            spi->transfer(chunk, n);
+            
+            data += n;
+            count -= n;
+        }
+#endif
+    }
+    
+    //drivers override these; the base versions just report that nothing moved
+    virtual uint32_t Write(uint32_t, const uint8_t*, uint32_t) {return 0;}
+    virtual uint32_t Flush(void) {return 0;} //commit anything a driver is holding back; returns bytes committed
+    
+    /*
+     * The segments are written back to back. Drivers combine writes that carry on from the last one,
+     * so a record that fits in a page still goes out as one page program. Stops at a short write.
+     */
+    uint32_t Write(uint32_t address, const FlashSegment* segments, uint8_t count);
+    uint32_t Write(uint32_t address, const BufferArray& data) {return Write(address, &data[0], data.GetSize());}
+    
+    /*
+     * Overwrites bytes that already hold data, which Write() can't do (programming only clears bits).
+     * Drivers that can rewrite a page in place override it; 0 means the driver can't.
+     */
+    virtual uint32_t Update(uint32_t, const uint8_t*, uint32_t) {return 0;}
+    uint32_t Update(uint32_t address, const BufferArray& data) {return Update(address, &data[0], data.GetSize());}
+    
+    /*
+     * One continuous read can be spread over several calls, so a caller can parse a long run
+     * without buffering all of it: BeginRead(), then ReceiveBytes() as often as needed, then
+     * EndRead(). BeginRead() returns 0 if the address is bad or the region is being erased.
+     */
+    virtual uint8_t BeginRead(uint32_t, uint32_t) {return 0;}
+    virtual void EndRead(void)
+    {
+        receiveHook = NULL;
+        Deselect();
+        EndAccess();
+    }
+    
+    /*
+     * it's up to the user to declare data to be the correct size
+     */
     virtual uint32_t ReadBytes(uint32_t address, uint8_t* data, uint32_t count);
     
-    uint32_t Erase(uint32_t addr, uint32_t size);
+    /*
+     * Read cache (see FLASH_READ_CACHE_BYTES). Writes and erases through this object keep it
+     * coherent; call ClearCache() if something else changes the chip. Hits and misses are
+     * counted per page touched.
+     */
+#if FLASH_READ_CACHE_BYTES
+    void ClearCache(void);
+    uint32_t GetCacheHits(void) {return cacheHits;}
+    uint32_t GetCacheMisses(void) {return cacheMisses;}
+    void ResetCacheCounts(void) {cacheHits = cacheMisses = 0;}
+#else
+    void ClearCache(void) {}
+    uint32_t GetCacheHits(void) {return 0;}
+    uint32_t GetCacheMisses(void) {return 0;}
+    void ResetCacheCounts(void) {}
+#endif
+    
+    virtual uint8_t IsBusy(void) {return 0;}
+    
+    void WaitWhileBusy(void)
+    {
+#if FLASH_INSTRUMENTATION
+        if(!IsBusy()) return;
+        
+        uint32_t startUs = micros();
+        while(IsBusy()) {}
+        
+        stats.busyWaits++;
+        stats.busyUs += micros() - startUs;
+#else
+        while(IsBusy()) {}
+#endif
+    }
 
-    friend class FlashStoreManager;
+#if FLASH_INSTRUMENTATION
+    //virtual, so an array reached through a Flash* reports its chips
+    const FlashStats& GetStats(void) {return stats;}
+    virtual void ResetStats(void) {stats = FlashStats();}
+    virtual void DumpStats(Print& out);
+#else
+    virtual void ResetStats(void) {}
+    virtual void DumpStats(Print&) {}
+#endif
+    
+    /*
+     * Asynchronous erase: StartErase() queues the range and returns a handle (0 if the queue is
+     * full or the range isn't aligned to the smallest erase). With the queue full, a range that runs on
+     * from a queued job without a callback joins it and shares its handle. Call Poll() from the main loop to move the queue
+     * along; it never waits on the chip and returns the number of jobs still outstanding.
+     * The callback, if any, is called from Poll() when the job finishes.
+     */
+    uint8_t StartErase(uint32_t addr, uint32_t size, EraseCallback callback = NULL);
+    
+    /*
+     * Splits a range into the fewest commands, always using the largest erase that is aligned
+     * at the current address and fits in what's left. Returns the expected time in ms
+     * (0 if the range can't be erased), and optionally the number of commands.
+     */
+    uint32_t PlanErase(uint32_t addr, uint32_t size, uint16_t* commands = NULL);
+    uint8_t Poll(void);
+    bool IsErasePending(uint8_t handle);
+    bool IsErasing(void) {return eraseJobs;}
+    
+    uint32_t Erase(uint32_t addr, uint32_t size); //blocking version
+
+    template <class> friend class FlashStoreManagerT;
+    friend class FlashArray;
+};
+
+/*
+ * Geometry of each supported chip, fixed at compile time. Everything is a power of two, so page
+ * splitting and alignment in the drivers (and in a FlashStoreManagerT bound to a driver) come
+ * down to shifts and masks on constants. Opcodes are already constants in each driver's .cpp.
+ */
+struct AT25DF641ATraits
+{
+    static const uint8_t PAGE_SHIFT = 8;
+    static const uint8_t BLOCK_SHIFT = 12; //smallest erase
+    
+    static const uint16_t PAGE_SIZE = 1 << PAGE_SHIFT;
+    static const uint16_t BLOCK_SIZE = 1 << BLOCK_SHIFT;
+    static const uint32_t PAGE_MASK = PAGE_SIZE - 1;
+    static const uint32_t BLOCK_MASK = BLOCK_SIZE - 1;
 };
 
-class FlashAT25DF641A : public Flash
+struct AT45DB321ETraits
 {
+    static const uint8_t PAGE_SHIFT = 9; //binary page size
+    static const uint8_t BLOCK_SHIFT = 12;
+    
+    static const uint16_t PAGE_SIZE = 1 << PAGE_SHIFT;
+    static const uint16_t BLOCK_SIZE = 1 << BLOCK_SHIFT;
+    static const uint32_t PAGE_MASK = PAGE_SIZE - 1;
+    static const uint32_t BLOCK_MASK = BLOCK_SIZE - 1;
+};
+
+/*
+ * The drivers are final, so calls made through a driver pointer or reference (rather than a Flash*)
+ * are bound at compile time, and the geometry getters below hide Flash's with constants.
+ */
+class FlashAT25DF641A final : public Flash
+{
+public:
+    typedef AT25DF641ATraits Traits;
+
 protected:
     void SendAddress(uint32_t addr)
     {
@@ -83,6 +530,22 @@ protected:
         spi->transfer(addr      );
     }
     
+    uint8_t SendErase(uint32_t address, uint8_t sizeCmd); //issues the command, doesn't wait
+    void SuspendErase(void);
+    void ResumeErase(void);
+    
+    //dual-output read (3Bh); readMode is what Init() settled on
+    uint8_t readSetting = FLASH_READ_AUTO;
+    uint8_t readMode = FLASH_READ_SINGLE;
+    ReceiveHook dualReceive = NULL;
+    
+    uint8_t ChooseReadMode(void);
+    
+    //write combining
+    uint8_t stage[Traits::PAGE_SIZE];
+    uint32_t stageAddress = 0; //flash address of stage[0]
+    uint16_t stageCount = 0;
+    
 public:
     FlashAT25DF641A(SPIClass* _spi, uint8_t cs) : Flash(_spi, cs)
     {
@@ -93,6 +556,9 @@ public:
     
     IDdata Init(void);
     
+    uint16_t GetPageSize(void) {return Traits::PAGE_SIZE;}
+    uint16_t GetBlockSize(void) {return Traits::BLOCK_SIZE;}
+    
     uint8_t IsBusy(void);    
     IDdata ReadIDdata(void);
     uint16_t ReadStatus(void);
@@ -100,13 +566,32 @@ public:
     /*
      * it's up to the user to declare data to be the correct size
      */
-    uint32_t ReadBytes(uint32_t address, uint8_t* data, uint32_t count);
+    uint8_t BeginRead(uint32_t address, uint32_t count);
+    
+    /*
+     * Dual-output read sends the command and address on one line and gets the data back on two,
+     * which the Arduino SPI library can't do, so the caller supplies the receive side. With
+     * FLASH_READ_AUTO, Init() reads the start of the chip both ways and only uses dual if they agree.
+     * Can be called before or after Init().
+     */
+    uint8_t SetReadMode(uint8_t mode, ReceiveHook dual = NULL);
+    uint8_t GetReadMode(void) {return readMode;}
 
     //uint8_t ReadByte(uint32_t address);
     
     uint8_t WriteEnable(void);
     uint8_t WriteDisable(void);
-    uint16_t WritePage(uint32_t address, uint8_t* data, uint16_t count);
+    uint16_t WritePage(uint32_t address, const uint8_t* data, uint16_t count);
+    
+    /*
+     * Write() combines small appends into whole-page programs: data collects in the staging
+     * buffer and goes out with one WriteEnable + page program when it reaches the end of a page.
+     * A write that doesn't carry on from the staged data, a read that overlaps it, or Flush()
+     * sends the partial page.
+     */
+    uint32_t Write(uint32_t address, const uint8_t* data, uint32_t count);
+    uint32_t Flush(void);
+    using Flash::Write;
     
     uint8_t EraseBlock(uint32_t, uint8_t);
     uint8_t EraseBlock4K(uint32_t address);
@@ -118,18 +603,36 @@ public:
     void GlobalProtect(void);
 };
 
-class FlashAT45DB321E : public Flash
+class FlashAT45DB321E final : public Flash
 {
+public:
+    typedef AT45DB321ETraits Traits;
+
 protected:
     //uint16_t currBufferIndex = 0; //byte index within a buffer [0..511]
     uint8_t currBuffer = 1; //SRAM buffer = 1 or 2
     
+    //ping-pong writer: currBuffer fills while the other one programs
+    bool filling = false; //currBuffer holds part of a page that hasn't been programmed
+    uint32_t fillStart = 0; //flash address of the first new byte in currBuffer
+    uint32_t fillAddress = 0; //flash address the next byte goes to
+    uint8_t programming = 0; //buffer with a program that may still be running, 0 if none
+    
+    void StartBuffer(uint32_t address);
+    void CommitBuffer(void);
+    
+    uint8_t StartRead(uint32_t address, uint32_t count);
+    
     void SendAddress(uint32_t address)
     {
         spi->transfer(address >> 16);
         spi->transfer(address >>  8);
         spi->transfer(address      );
     }
+    
+    uint8_t SendErase(uint32_t address, uint8_t sizeCmd); //issues the command, doesn't wait
+    void SuspendErase(void);
+    void ResumeErase(void);
                                     
 public:
     FlashAT45DB321E(SPIClass* _spi, uint8_t cs) : Flash(_spi, cs)
@@ -141,16 +644,32 @@ public:
     
     IDdata Init(void);
     
+    uint16_t GetPageSize(void) {return Traits::PAGE_SIZE;}
+    uint16_t GetBlockSize(void) {return Traits::BLOCK_SIZE;}
+    
     uint8_t IsReady(void);
     uint8_t IsBusy(void);
     IDdata ReadIDdata(void);
     uint16_t ReadStatus(void);
     
-    uint32_t Write(uint32_t addr, const BufferArray&);
-    uint32_t ReadBytes(uint32_t address, uint8_t* data, uint32_t count);
+    /*
+     * Write() streams through the two SRAM buffers: one fills while the other programs, and the
+     * chip is only polled when a buffer is about to be reused or programmed. A partial page stays
+     * in SRAM until more data follows it; Flush() programs it and waits, so the data is durable.
+     */
+    uint32_t Write(uint32_t addr, const uint8_t* data, uint32_t count);
+    uint32_t Flush(void);
+    uint32_t Update(uint32_t addr, const uint8_t* data, uint32_t count); //one page program (with erase) per page touched
+    using Flash::Write;
+    using Flash::Update;
+    uint8_t BeginRead(uint32_t address, uint32_t count);
+    uint32_t ReadBytes(uint32_t address, uint8_t* data, uint32_t count); //new data comes from SRAM
     
-    uint32_t BufferWrite(uint8_t* data, uint16_t count, uint8_t bufferNumber, uint16_t byteAddress);
-    uint8_t WriteBufferToPage(uint8_t bufferNumber, uint32_t pageIndex, bool erase = false);
+    uint32_t BufferRead(uint8_t* data, uint16_t count, uint8_t bufferNumber, uint16_t byteAddress);
+    uint32_t BufferWrite(const uint8_t* data, uint16_t count, uint8_t bufferNumber, uint16_t byteAddress);
+    uint32_t BufferFill(uint16_t count, uint8_t bufferNumber, uint16_t byteAddress); //0xff, which programs nothing
+    uint8_t WriteBufferToPage(uint8_t bufferNumber, uint32_t pageAddr, bool erase = false);
+    uint8_t PageToBuffer(uint32_t pageAddr, uint8_t bufferNumber);
 
     uint32_t EraseBlock(uint32_t address) {return EraseBlock4K(address);}
     
@@ -163,4 +682,69 @@ public:
 //                                              uint16_t pageIndex, uint16_t byteAddress);
 };
 
+/*
+ * Several identical chips as one device, so a FlashStoreManager can span all the parts on a board.
+ * Concatenated, each chip follows the last. Striped, consecutive pages go to consecutive chips: while
+ * one chip programs a page the next one is already on its way to another, and a block is the same
+ * block on every chip, erased on all of them at once. Streaming writes and erases then go about as
+ * many times faster as there are chips, and blocks are that many times bigger (so striping takes
+ * two or four chips, or eight).
+ *
+ * Init() the chips first (each can have its own SPI bus, and be clock-tuned on its own); the array
+ * takes its geometry from them. Erases go through the array's queue rather than the chips' own, and
+ * a chip's erase is only suspended while that chip is being accessed.
+ */
+class FlashArray : public Flash
+{
+protected:
+    Flash* chips[FLASH_ARRAY_CHIPS];
+    uint8_t chipCount = 0;
+    uint8_t layout = FLASH_STRIPE;
+    uint32_t chipBytes = 0;
+    
+    EraseOp arrayOps[FLASH_MAX_ERASE_OPS]; //the chips' erases, scaled to the array
+    
+    uint8_t erasing = 0; //chips that may still be running an erase, one bit each
+    uint8_t suspended = 0; //chips whose erase is suspended for an access
+    
+    uint32_t readAddress = 0; //where ReceiveBytes() carries on from
+    
+    //the chip holding address and the address on it; count is trimmed to what's there in one run
+    uint32_t Locate(uint32_t address, uint32_t& count, uint8_t& chip);
+    
+    void BeginChip(uint8_t chip); //suspends an erase running on it
+    void EndChip(uint8_t chip);
+    
+    uint8_t SendErase(uint32_t address, uint8_t sizeCmd); //issues the command on the chips involved
+
+public:
+    FlashArray(Flash* const* devices, uint8_t count, uint8_t arrangement = FLASH_STRIPE);
+    
+    IDdata Init(void); //chip 0's ID; the byte count stays 0 if the chips don't match
+    
+    uint8_t GetChipCount(void) {return chipCount;}
+    Flash* GetChip(uint8_t i) {return i < chipCount ? chips[i] : NULL;}
+    
+    IDdata ReadIDdata(void) {return chipCount ? chips[0]->ReadIDdata() : idData;}
+    uint8_t IsBusy(void); //any of them
+    
+    uint32_t Write(uint32_t address, const uint8_t* data, uint32_t count);
+    uint32_t Flush(void);
+    uint32_t Update(uint32_t address, const uint8_t* data, uint32_t count); //0 if the chips can't
+    using Flash::Write;
+    using Flash::Update;
+    
+    //a streamed read is a run of ReadBytes() on whichever chips it crosses
+    uint8_t BeginRead(uint32_t address, uint32_t count);
+    void ReceiveBytes(uint8_t* data, uint32_t count) {readAddress += ReadBytes(readAddress, data, count);}
+    void EndRead(void) {}
+    uint32_t ReadBytes(uint32_t address, uint8_t* data, uint32_t count);
+    
+    //each chip's numbers in turn (the array itself keeps none)
+#if FLASH_INSTRUMENTATION
+    void DumpStats(Print& out);
+    void ResetStats(void);
+#endif
+};
+
 #endif /* flash_h */
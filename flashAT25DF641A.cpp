@@ -11,6 +11,7 @@
 #define CMD_WRITE_STATUS1   0x01
 #define CMD_WRITE           0x02
 #define CMD_READ_DATA       0x0B
+#define CMD_READ_DUAL       0x3B
 
 #define CMD_WRITE_DISABLE   0x04
 #define CMD_READ_STATUS     0x05
@@ -20,6 +21,9 @@
 #define CMD_ERASE_BLOCK_32K    0x52
 #define CMD_ERASE_BLOCK_64K    0xD8
 
+#define CMD_SUSPEND         0xB0
+#define CMD_RESUME          0xD0
+
 #define CMD_READ_ID_DATA    0x9F
 #define CMD_READ_PROTECTION_STATUS    0x3C
 
@@ -29,30 +33,33 @@
 #define STATUS_BSY      0x01
 #define STATUS_WEL      0x02
 
+//largest first, for the erase planner
+static const EraseOp eraseOpsAT25[] =
+{
+    {65536, CMD_ERASE_BLOCK_64K, 400, 0},
+    {32768, CMD_ERASE_BLOCK_32K, 250, 0},
+    { 4096, CMD_ERASE_BLOCK_4K,   50, 0},
+};
+
 IDdata FlashAT25DF641A::Init(void)
 {
-    pinMode(chipSelect, OUTPUT);
-    digitalWrite(chipSelect, HIGH);
-    
-    Deselect();
+    Flash::Init();
     
-    //this might not play well with others...
-    spi->setDataMode(SPI_MODE0);
-    spi->setBitOrder(MSBFIRST);
-    spi->setClockDivider(SPI_CLOCK_DIV64); //why slow it down?
-    
-    spi->begin();
-    
-    idData = ReadIDdata();
+    idData = ReadIDdataSafely();
     
     if(idData.manufacturerID != 0x1F) SerialUSB.print("Wrong manufacturer!");
     
     byteCount = (uint32_t)1 << (15 + (idData.deviceID1 & 0x1F));
 
     //hard-coded for now...
-    bytesPerPage = 256;
-    bytesPerBlock = 4096;
+    bytesPerPage = Traits::PAGE_SIZE;
+    bytesPerBlock = Traits::BLOCK_SIZE;
     //totalPages = byteCount / bytesPerPage;
+    
+    eraseOps = eraseOpsAT25;
+    eraseOpCount = sizeof(eraseOpsAT25) / sizeof(EraseOp);
+    
+    ChooseReadMode();
         
     return idData;
 }
@@ -98,28 +105,66 @@ uint16_t FlashAT25DF641A::ReadStatus(void)
     return status;
 }
 
-    
+
 /*
- * it's up to the user to declare data to be the correct size
+ * starts a fast read; the caller clocks the data out with ReceiveBytes() and finishes with EndRead()
  */
-uint32_t FlashAT25DF641A::ReadBytes(uint32_t address, uint8_t* data, uint32_t count)
+uint8_t FlashAT25DF641A::BeginRead(uint32_t address, uint32_t count)
 {
     if(address >= byteCount) return 0; //basic check for address range
     
+    //read your own writes
+    if(stageCount && address < stageAddress + stageCount && stageAddress < address + count) Flush();
+    
+    if(!BeginAccess(address, count)) return 0; //region is being erased
+    
+    WaitWhileBusy(); //let a page program finish
+    
     Select();
-    SendCommand(CMD_READ_DATA);
+    SendCommand(readMode == FLASH_READ_DUAL ? CMD_READ_DUAL : CMD_READ_DATA);
     SendAddress(address);
-    if(CMD_READ_DATA == 0x0b) SendCommand(0x0); //dummy bits for fast read
+    SendCommand(0x0); //dummy bits for fast read (both take one byte)
+    
+    if(readMode == FLASH_READ_DUAL) receiveHook = dualReceive;
+    
+    return 1;
+}
+
+uint8_t FlashAT25DF641A::SetReadMode(uint8_t mode, ReceiveHook dual)
+{
+    readSetting = mode;
+    dualReceive = dual;
     
-    uint32_t i = 0;
-    for( ; i < count; i++) //need to check requested size!
+    return byteCount ? ChooseReadMode() : readSetting; //before Init(), that does it
+}
+
+uint8_t FlashAT25DF641A::ChooseReadMode(void)
+{
+    readMode = FLASH_READ_SINGLE;
+    if(!dualReceive || readSetting == FLASH_READ_SINGLE) return readMode;
+    
+    if(readSetting == FLASH_READ_DUAL)
     {
-        data[i] = spi->transfer(0x0);
+        readMode = FLASH_READ_DUAL;
+        return readMode;
     }
     
-    Deselect();
+    //auto: the FAT end of the chip, read both ways (straight from the chip, not through the cache)
+    //a blank chip reads the same either way, so then the transport gets the benefit of the doubt
+    uint8_t single[32];
+    uint8_t dual[32];
+    if(!BeginRead(0, sizeof(single))) return readMode;
+    ReceiveBytes(single, sizeof(single));
+    EndRead();
     
-    return i;
+    readMode = FLASH_READ_DUAL;
+    if(!BeginRead(0, sizeof(dual))) return readMode = FLASH_READ_SINGLE;
+    ReceiveBytes(dual, sizeof(dual));
+    EndRead();
+    
+    if(memcmp(single, dual, sizeof(single))) readMode = FLASH_READ_SINGLE;
+    
+    return readMode;
 }
 
 //uint8_t FlashAT25DF641A::ReadByte(uint32_t address)
@@ -140,15 +185,13 @@ uint32_t FlashAT25DF641A::ReadBytes(uint32_t address, uint8_t* data, uint32_t co
 
 uint8_t FlashAT25DF641A::WriteEnable(void)
 {
-    while(IsBusy()) {}
+    WaitWhileBusy();
     
     Select();
     SendCommand(CMD_WRITE_ENABLE);
     Deselect();
     
-    Select();
     uint16_t status = ReadStatus();
-    Deselect();
     
     return (status >> 8) & STATUS_WEL;
 }
@@ -159,17 +202,26 @@ uint8_t FlashAT25DF641A::WriteDisable(void)
     SendCommand(CMD_WRITE_DISABLE);
     Deselect();
     
-    Select();
     uint16_t status = ReadStatus();
-    Deselect();
     
     return (status >> 8) & STATUS_WEL;
 }
 
-uint16_t FlashAT25DF641A::WritePage(uint32_t address, uint8_t* data, uint16_t count)
+/*
+ * programs within one page; anything past the end of the page is left for the caller
+ * (the chip would wrap around to the start of the page)
+ */
+uint16_t FlashAT25DF641A::WritePage(uint32_t address, const uint8_t* data, uint16_t count)
 {
     if(address >= byteCount) return 0; //basic check for address range
     
+    uint16_t room = Traits::PAGE_SIZE - (address & Traits::PAGE_MASK);
+    if(count > room) count = room;
+    if(!BeginAccess(address, count)) return 0; //region is being erased
+    InvalidateCache(address, count);
+    
+    FLASH_STAT(uint32_t startUs = micros());
+    
     WriteEnable();
     
     Select(); //should check for WEL bit
@@ -177,30 +229,99 @@ uint16_t FlashAT25DF641A::WritePage(uint32_t address, uint8_t* data, uint16_t co
     
     SendAddress(address);
 
-    uint16_t i = 0;
-    for( ; i < count; i++)
-    {
-        spi->transfer(data[i]);
-    }
+    TransmitBytes(data, count);
 
     Deselect();
+    EndAccess();
 
     //while(IsBusy()) {} //up to the user to make sure the write is done,
     //returning now let's it can happen in the background
     
-    return i;
+    FLASH_STAT(stats.program.Add(micros() - startUs));
+    FLASH_STAT(stats.programs++);
+    FLASH_STAT(stats.bytesProgrammed += count);
+    
+    return count;
 }
 
-uint8_t FlashAT25DF641A::EraseBlock(uint32_t address, uint8_t sizeCmd)
+uint32_t FlashAT25DF641A::Write(uint32_t address, const uint8_t* data, uint32_t count)
+{
+    if(address >= byteCount) return 0; //basic check for address range
+    
+    if(count > byteCount - address) count = byteCount - address;
+    if(IsQueuedForErase(address, count)) return 0;
+    InvalidateCache(address, count); //staged data isn't on the chip yet
+    
+    //anything that doesn't carry on from the staged data sends it first
+    if(stageCount && address != stageAddress + stageCount) Flush();
+    if(stageCount && address != stageAddress + stageCount) return 0; //couldn't
+    
+    FLASH_STAT(uint32_t startUs = micros());
+    
+    uint32_t written = 0;
+    while(written < count)
+    {
+        uint32_t curr = address + written;
+        uint16_t room = Traits::PAGE_SIZE - (curr & Traits::PAGE_MASK); //to the end of the page
+        uint32_t n = count - written;
+        if(n > room) n = room;
+        
+        //whole pages go straight out
+        if(!stageCount && n == Traits::PAGE_SIZE)
+        {
+            if(WritePage(curr, data + written, n) != n) break;
+            written += n;
+            continue;
+        }
+        
+        if(!stageCount) stageAddress = curr;
+        memcpy(&stage[stageCount], data + written, n);
+        stageCount += n;
+        written += n;
+        
+        if(n == room && !Flush()) break; //filled the page
+    }
+    
+    FLASH_STAT(stats.write.Add(micros() - startUs));
+    
+    return written;
+}
+
+uint32_t FlashAT25DF641A::Flush(void)
+{
+    if(!stageCount) return 0;
+    
+    uint16_t count = WritePage(stageAddress, stage, stageCount);
+    if(count == stageCount) stageCount = 0;
+    else count = 0; //still staged
+    
+    return count;
+}
+
+uint8_t FlashAT25DF641A::SendErase(uint32_t address, uint8_t sizeCmd)
 {
     if(address >= byteCount) return 0; //basic check for address range
     
+    WriteEnable();
+    FLASH_STAT(CountErase(sizeCmd));
+    
     Select();
     SendCommand(sizeCmd);
     SendAddress(address);
     Deselect();
     
-    while(IsBusy()) {}
+    return 1;
+}
+
+uint8_t FlashAT25DF641A::EraseBlock(uint32_t address, uint8_t sizeCmd)
+{
+    FLASH_STAT(uint32_t startUs = micros());
+    
+    if(!SendErase(address, sizeCmd)) return 0;
+    ClearCache(); //rare enough not to bother working out the size
+    
+    WaitWhileBusy();
+    FLASH_STAT(stats.erase.Add(micros() - startUs));
     
     return 1;
 }
@@ -223,10 +344,26 @@ uint8_t FlashAT25DF641A::EraseBlock64K(uint32_t address)
     
 }
 
+void FlashAT25DF641A::SuspendErase(void)
+{
+    Select();
+    SendCommand(CMD_SUSPEND);
+    Deselect();
+}
+
+void FlashAT25DF641A::ResumeErase(void)
+{
+    Select();
+    SendCommand(CMD_RESUME);
+    Deselect();
+}
+
 uint8_t FlashAT25DF641A::ReadSectorProtectionStatus(uint32_t address)
 {
     if(address >= byteCount) return 0; //basic check for address range
     
+    WaitWhileBusy();
+    
     Select();
     
     SendCommand(CMD_READ_PROTECTION_STATUS);
@@ -234,8 +371,6 @@ uint8_t FlashAT25DF641A::ReadSectorProtectionStatus(uint32_t address)
     
     uint8_t status = spi->transfer(0x0);
     
-    while(IsBusy()) {}
-    
     Deselect();
     
     return status;
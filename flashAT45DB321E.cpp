@@ -10,6 +10,8 @@
 
 #define CMD_WRITE_THRU_BUFFER   0x02
 #define CMD_READ_DATA           0x0B
+#define CMD_READ_BUFFER_1       0xD4
+#define CMD_READ_BUFFER_2       0xD6
 
 //#define CMD_WRITE_DISABLE   0x04
 //#define CMD_WRITE_ENABLE    0x06
@@ -20,14 +22,25 @@
 #define CMD_ERASE_SECTOR        0x7C
 //#define CMD_ERASE_CHIP          C7h, 94h, 80h, and 9Ah
 
+#define CMD_SUSPEND         0xB0
+#define CMD_RESUME          0xD0
+
 #define CMD_READ_ID_DATA    0x9F
 #define STATUS_RDY      0x80
 
+//largest first, for the erase planner; sector 0 is split (0a/0b), so whole sectors start at 64K
+static const EraseOp eraseOpsAT45[] =
+{
+    {65536, CMD_ERASE_SECTOR,   700, 65536},
+    { 4096, CMD_ERASE_BLOCK_4K,  45, 0},
+    {  512, CMD_ERASE_PAGE,       8, 0},
+};
+
 IDdata FlashAT45DB321E::Init(void)
 {
     Flash::Init();
     
-    idData = ReadIDdata();
+    idData = ReadIDdataSafely();
     
     //check it's an Adesto
     if(idData.manufacturerID != 0x1F) SerialUSB.print("Wrong manufacturer!");
@@ -38,9 +51,12 @@ IDdata FlashAT45DB321E::Init(void)
     byteCount = (uint32_t)1 << (15 + (idData.deviceID1 & 0x1F));
 
     //hard-coded for now...
-    bytesPerPage = 512;
-    bytesPerBlock = 4096;
+    bytesPerPage = Traits::PAGE_SIZE;
+    bytesPerBlock = Traits::BLOCK_SIZE;
     //totalPages = byteCount / bytesPerPage;
+    
+    eraseOps = eraseOpsAT45;
+    eraseOpCount = sizeof(eraseOpsAT45) / sizeof(EraseOp);
         
     return idData;
 }
@@ -91,6 +107,9 @@ uint16_t FlashAT45DB321E::ReadStatus(void)
     return status;
 }
 
+/*
+ * pageAddr is any byte address within the page; the byte bits are ignored
+ */
 uint8_t FlashAT45DB321E::WriteBufferToPage(uint8_t bufferNumber, uint32_t pageAddr, bool erase)
 {
     //with erase:       83h for Buffer 1 or 86h for Buffer 2
@@ -103,6 +122,8 @@ uint8_t FlashAT45DB321E::WriteBufferToPage(uint8_t bufferNumber, uint32_t pageAd
     else if(bufferNumber == 2 && !erase) op_code = 0x89;
     else return 0;
     
+    InvalidateCache(pageAddr & ~Traits::PAGE_MASK, Traits::PAGE_SIZE);
+    
     Select();
     SendCommand(op_code);
     SendAddress(pageAddr);
@@ -111,95 +132,344 @@ uint8_t FlashAT45DB321E::WriteBufferToPage(uint8_t bufferNumber, uint32_t pageAd
     return 1;
 }
     
+/*
+ * Copies a main memory page into an SRAM buffer. The transfer keeps the chip busy for a couple
+ * of hundred us; pageAddr is any byte address within the page.
+ */
+uint8_t FlashAT45DB321E::PageToBuffer(uint32_t pageAddr, uint8_t bufferNumber)
+{
+    //53h for Buffer 1 or 55h for Buffer 2
+    uint8_t op_code = 0x00;
+    if(bufferNumber == 1) op_code = 0x53;
+    else if(bufferNumber == 2) op_code = 0x55;
+    else return 0;
+    
+    Select();
+    SendCommand(op_code);
+    SendAddress(pageAddr);
+    Deselect();
+    
+    return 1;
+}
+
 /*
  * To perform a Continuous Array Read using the binary page size (512 bytes),
  * the opcode 0Bh must be clocked into the device followed by three address bytes (A21 - A0)
  * and one dummy byte.
  *
- * it's up to the user to declare data to be the correct size
+ * The caller clocks the data out with ReceiveBytes() and finishes with EndRead().
  */
-uint32_t FlashAT45DB321E::ReadBytes(uint32_t address, uint8_t* data, uint32_t count)
+uint8_t FlashAT45DB321E::BeginRead(uint32_t address, uint32_t count)
 {
     if(address >= byteCount) return 0; //basic check for address range
     
+    //read your own writes: a stream can't switch to SRAM part way, so new data it covers is programmed first
+    if(filling && address < fillAddress && fillStart < address + count) Flush();
+    
+    return StartRead(address, count);
+}
+
+/*
+ * BeginRead() without the check on currBuffer
+ */
+uint8_t FlashAT45DB321E::StartRead(uint32_t address, uint32_t count)
+{
+    if(!BeginAccess(address, count)) return 0; //region is being erased
+    
+    WaitWhileBusy(); //let a page program finish
+    
     Select();
     SendCommand(CMD_READ_DATA);
     SendAddress(address);
     if(CMD_READ_DATA == 0x0b) SendCommand(0x0); //dummy bits for fast read
     
-    uint32_t i = 0;
-    for( ; i < count; i++) //need to check requested size!
+    return 1;
+}
+
+/*
+ * Reads that reach data still sitting in currBuffer get it straight from SRAM, rather than
+ * programming the page early (and waiting for it) or returning the 0xff still in main memory.
+ * Anything either side of it comes from main memory.
+ */
+uint32_t FlashAT45DB321E::ReadBytes(uint32_t address, uint8_t* data, uint32_t count)
+{
+    if(address >= byteCount) return 0; //basic check for address range
+    if(count > byteCount - address) count = byteCount - address;
+    
+    if(!filling || address >= fillAddress || fillStart >= address + count) return Flash::ReadBytes(address, data, count);
+    
+    FLASH_STAT(uint32_t startUs = micros());
+    
+    //in front of the new data; goes around the cache, which would fetch (and so program) the whole page
+    uint32_t done = 0;
+    if(address < fillStart)
     {
-        data[i] = spi->transfer(0x0);
+        done = fillStart - address;
+        if(!StartRead(address, done)) return 0;
+        ReceiveBytes(data, done);
+        EndRead();
     }
     
-    Deselect();
+    //the new data
+    uint32_t end = address + count < fillAddress ? address + count : fillAddress;
+    BufferRead(data + done, end - address - done, currBuffer, (address + done) & Traits::PAGE_MASK);
+    done = end - address;
+    
+    //past it
+    if(done < count && StartRead(address + done, count - done))
+    {
+        ReceiveBytes(data + done, count - done);
+        EndRead();
+        done = count;
+    }
     
-    return i;
+    FLASH_STAT(stats.read.Add(micros() - startUs));
+    
+    return done;
 }
 
 //Write() allows the user to just write a stream of data without concerns for the underlying structure
-uint32_t FlashAT45DB321E::Write(uint32_t address, const BufferArray& data)
+uint32_t FlashAT45DB321E::Write(uint32_t address, const uint8_t* data, uint32_t count)
 {
-    uint16_t currBufferIndex = address & 0x1ff; //start byte within the buffer
+    if(address >= byteCount) return 0; //basic check for address range
+    
+    if(count > byteCount - address) count = byteCount - address;
+    
+    //a write that doesn't carry on from the page being filled commits that page first
+    if(filling && address != fillAddress) Flush();
+    
+    if(!BeginAccess(address, count)) return 0; //region is being erased
+    InvalidateCache(address, count); //a partial page sits in SRAM until it's committed
+    
+    FLASH_STAT(uint32_t startUs = micros());
+    
     uint32_t bytesWritten = 0;
+    while(bytesWritten < count)
+    {
+        //send everything up to the end of the buffer in one go
+        uint16_t currBufferIndex = (address + bytesWritten) & Traits::PAGE_MASK;
+        uint32_t run = Traits::PAGE_SIZE - currBufferIndex;
+        if(run > count - bytesWritten) run = count - bytesWritten;
+        
+        if(!filling) StartBuffer(address + bytesWritten);
+        
+        BufferWrite(data + bytesWritten, run, currBuffer, currBufferIndex);
+        bytesWritten += run;
+        fillAddress += run;
+        
+        //if buffer is full, write the buffer and switch to other one
+        if(!(fillAddress & Traits::PAGE_MASK)) CommitBuffer();
+    }
+    
+    EndAccess();
+    
+    FLASH_STAT(stats.write.Add(micros() - startUs));
+    
+    return bytesWritten;
+}
+
+/*
+ * Rewrites bytes in place a page at a time: the page is copied into SRAM, patched there, and
+ * programmed back with the built-in erase, so the rest of the page and its block are untouched.
+ * Like Write(), it returns with the last program still running; Flush() waits for it.
+ */
+uint32_t FlashAT45DB321E::Update(uint32_t address, const uint8_t* data, uint32_t count)
+{
+    if(address >= byteCount) return 0; //basic check for address range
+    
+    if(count > byteCount - address) count = byteCount - address;
+    
+    Flush(); //frees both buffers, and commits anything pending that the update might cover
+    
+    uint32_t bytesWritten = 0;
+    while(bytesWritten < count)
+    {
+        uint32_t page = (address + bytesWritten) & ~Traits::PAGE_MASK;
+        uint16_t currBufferIndex = (address + bytesWritten) & Traits::PAGE_MASK;
+        uint32_t run = Traits::PAGE_SIZE - currBufferIndex;
+        if(run > count - bytesWritten) run = count - bytesWritten;
+        
+        //programming with erase isn't allowed while an erase is suspended, so let a running one finish
+        WaitWhileBusy();
+        if(!BeginAccess(page, Traits::PAGE_SIZE)) break; //page is queued for erase
+        
+        FLASH_STAT(uint32_t startUs = micros());
+        FLASH_STAT(stats.programs++);
+        FLASH_STAT(stats.bytesProgrammed += run);
+        
+        PageToBuffer(page, currBuffer);
+        WaitWhileBusy();
+        
+        BufferWrite(data + bytesWritten, run, currBuffer, currBufferIndex);
+        WriteBufferToPage(currBuffer, page, true);
+        programming = currBuffer;
+        currBuffer = currBuffer == 1 ? 2 : 1;
+        
+        EndAccess();
+        
+        FLASH_STAT(stats.program.Add(micros() - startUs));
+        
+        bytesWritten += run;
+    }
+    
+    return bytesWritten;
+}
+
+/*
+ * Gets currBuffer ready for a new page. Bytes in front of the new data are set to 0xff,
+ * which the program-without-erase leaves alone, so there's no need to read the page in first.
+ */
+void FlashAT45DB321E::StartBuffer(uint32_t address)
+{
+    //only wait if this buffer's last program might still be running
+    if(programming == currBuffer)
+    {
+        WaitWhileBusy();
+        programming = 0;
+    }
+    
+    uint16_t currBufferIndex = address & Traits::PAGE_MASK;
+    if(currBufferIndex) BufferFill(currBufferIndex, currBuffer, 0);
     
+    fillStart = address;
+    fillAddress = address;
+    filling = true;
+}
+
+/*
+ * programs currBuffer into its page and switches to the other buffer (which can be
+ * filled while this one is writing)
+ */
+void FlashAT45DB321E::CommitBuffer(void)
+{
+    FLASH_STAT(uint32_t startUs = micros());
+    FLASH_STAT(stats.programs++);
+    FLASH_STAT(stats.bytesProgrammed += fillAddress - fillStart);
+
+    uint16_t currBufferIndex = fillAddress & Traits::PAGE_MASK;
+    if(currBufferIndex) BufferFill(Traits::PAGE_SIZE - currBufferIndex, currBuffer, currBufferIndex);
+    
+    WaitWhileBusy(); //one program at a time
+    
+    WriteBufferToPage(currBuffer, fillStart, false); //assumes already erased
+    programming = currBuffer;
+    
+    currBuffer = currBuffer == 1 ? 2 : 1;
+    filling = false;
+    
+    FLASH_STAT(stats.program.Add(micros() - startUs));
+}
+
+uint32_t FlashAT45DB321E::Flush(void)
+{
+    uint32_t count = 0;
+    
+    if(filling)
+    {
+        uint32_t page = fillStart & ~Traits::PAGE_MASK;
+        if(!BeginAccess(page, Traits::PAGE_SIZE)) return 0; //page is queued for erase
+        
+        count = fillAddress - fillStart;
+        CommitBuffer();
+        
+        //durable: wait for the program before EndAccess() resumes an erase, or we'd wait for that too
+        WaitWhileBusy();
+        programming = 0;
+        
+        EndAccess();
+    }
+    else if(programming)
+    {
+        //left running by Write(); an erase only starts (or resumes) once the chip is idle, so if one
+        //has been issued since, the program is already done and the chip is busy with the erase
+        if(!eraseIssued) WaitWhileBusy();
+        programming = 0;
+    }
+    
+    return count;
+}
+
+uint32_t FlashAT45DB321E::BufferWrite(const uint8_t* data, uint16_t count, uint8_t bufferNumber, uint16_t byteAddress)
+{
     //84h for Buffer 1 or 87h for Buffer 2
-    uint8_t op_code = 0x84; //defaults to buffer 1
-    if(currBuffer == 2) op_code = 0x87;
+    uint8_t op_code = 0x00;
+    if(bufferNumber == 1) op_code = 0x84;
+    else if(bufferNumber == 2) op_code = 0x87;
+    else return 0;
     
     Select();
     SendCommand(op_code);
-    SendAddress(address); //writing to buffer, page address is irrelevant, but byte within buffer is important
+    SendAddress(byteAddress); //writing to buffer, page address is irrelevant
+    
+    TransmitBytes(data, count);
+    
+    Deselect();
+    
+    return count;
+}
 
-    uint16_t i = 0;
-    while(i < data.GetSize())
+/*
+ * SRAM can be read while the chip is busy programming the other buffer or erasing, so there's no wait
+ */
+uint32_t FlashAT45DB321E::BufferRead(uint8_t* data, uint16_t count, uint8_t bufferNumber, uint16_t byteAddress)
+{
+    //D4h for Buffer 1 or D6h for Buffer 2, both with a dummy byte
+    uint8_t op_code = 0x00;
+    if(bufferNumber == 1) op_code = CMD_READ_BUFFER_1;
+    else if(bufferNumber == 2) op_code = CMD_READ_BUFFER_2;
+    else return 0;
+    
+    Select();
+    SendCommand(op_code);
+    SendAddress(byteAddress); //page address is irrelevant
+    SendCommand(0x0); //dummy byte
+    
+    ReceiveBytes(data, count);
+    
+    Deselect();
+    
+    return count;
+}
+
+uint32_t FlashAT45DB321E::BufferFill(uint16_t count, uint8_t bufferNumber, uint16_t byteAddress)
+{
+    uint8_t fill[FLASH_SPI_CHUNK];
+    memset(fill, 0xff, sizeof(fill));
+    
+    uint16_t written = 0;
+    while(written < count)
     {
-        spi->transfer(data[i++]);
-        bytesWritten++;
-        
-        if(++currBufferIndex == bytesPerPage) //if buffer is full, write the buffer and switch to other one
-        {
-            Deselect();
-            
-            WriteBufferToPage(currBuffer, address, false); //assumes already erased; ignores byte address part of address
-            //currAddress += bytesPerPage;
-            
-            if(currBuffer == 1)
-            {
-                currBuffer = 2;
-                op_code = 0x87;
-            }
-            else
-            {
-                currBuffer = 1;
-                op_code = 0x84;
-            }
-
-            //pick up with the other buffer (can be done while the one is writing)
-            Select();
-            SendCommand(op_code);
-            SendAddress(0x0); //writing to start of buffer, page address is irrelevant
-            
-            currBufferIndex = 0;
-        }
+        uint16_t n = count - written < FLASH_SPI_CHUNK ? count - written : FLASH_SPI_CHUNK;
+        written += BufferWrite(fill, n, bufferNumber, byteAddress + written);
     }
     
-    Deselect(); //this won't write the buffer to flash: could lose the last page of data
-    
-    return bytesWritten;
+    return written;
 }
 
-uint8_t FlashAT45DB321E::EraseBlock(uint32_t address, uint8_t sizeCmd)
+uint8_t FlashAT45DB321E::SendErase(uint32_t address, uint8_t sizeCmd)
 {
     if(address >= byteCount) return 0; //basic check for address range
     
+    WaitWhileBusy();
+    FLASH_STAT(CountErase(sizeCmd));
+    
     Select();
     SendCommand(sizeCmd);
     SendAddress(address);
     Deselect();
     
-    while(IsBusy()) {}
+    return 1;
+}
+
+uint8_t FlashAT45DB321E::EraseBlock(uint32_t address, uint8_t sizeCmd)
+{
+    FLASH_STAT(uint32_t startUs = micros());
+    
+    if(!SendErase(address, sizeCmd)) return 0;
+    ClearCache(); //rare enough not to bother working out the size
+    
+    WaitWhileBusy();
+    FLASH_STAT(stats.erase.Add(micros() - startUs));
     
     return 1;
 }
@@ -216,30 +486,21 @@ uint8_t FlashAT45DB321E::EraseSector(uint32_t address)
     
 }
 
+void FlashAT45DB321E::SuspendErase(void)
+{
+    Select();
+    SendCommand(CMD_SUSPEND);
+    Deselect();
+}
+
+void FlashAT45DB321E::ResumeErase(void)
+{
+    Select();
+    SendCommand(CMD_RESUME);
+    Deselect();
+}
 
 
-//uint32_t FlashAT45DB321E::BufferWrite(uint8_t* data, uint16_t count, uint8_t bufferNumber, uint16_t byteAddress)
-//{
-//    //84h for Buffer 1 or 87h for Buffer 2
-//    uint8_t op_code = 0x00;
-//    if(bufferNumber == 1) op_code = 0x84;
-//    else if(bufferNumber == 2) op_code = 0x87;
-//    else return 0;
-//
-//    Select();
-//    SendCommand(op_code);
-//    SendAddress(MakeAddress(0x00, byteAddress)); //writing to buffer, page address is irrelevant
-//
-//    uint16_t i = 0;
-//    for( ; i < count; i++)
-//    {
-//        spi->transfer(data[i]);
-//    }
-//
-//    Deselect();
-//
-//    return i;
-//}
 
 //uint32_t FlashAT45DB321E::WriteThruBuffer(uint8_t* data, uint16_t count, uint8_t bufferNumber,
 //                                          uint16_t pageIndex, uint16_t byteAddress)
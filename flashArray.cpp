@@ -0,0 +1,278 @@
+//
+//  flashArray.cpp
+//  flash
+//
+//  Several chips presented as one Flash: address mapping, and the erase engine's hooks spread
+//  over the chips.
+//
+
+#include "flash.h"
+
+FlashArray::FlashArray(Flash* const* devices, uint8_t count, uint8_t arrangement)
+{
+    if(count > FLASH_ARRAY_CHIPS) count = FLASH_ARRAY_CHIPS;
+    for(uint8_t i = 0; i < count; i++) chips[i] = devices[i];
+    
+    chipCount = count;
+    layout = arrangement;
+}
+
+IDdata FlashArray::Init(void)
+{
+    byteCount = 0;
+    if(!chipCount) return idData;
+    
+    Flash* first = chips[0];
+    idData = first->GetIDdata();
+    
+    //erase sizes and blocks have to stay powers of two
+    if(layout == FLASH_STRIPE && (chipCount & (chipCount - 1))) return idData;
+    
+    //the mapping assumes every chip is the same part
+    for(uint8_t i = 1; i < chipCount; i++)
+    {
+        if(chips[i]->byteCount != first->byteCount || chips[i]->bytesPerPage != first->bytesPerPage
+           || chips[i]->eraseOps != first->eraseOps) return idData;
+    }
+    
+    chipBytes = first->byteCount;
+    bytesPerPage = first->bytesPerPage;
+    bytesPerBlock = first->bytesPerBlock * (layout == FLASH_STRIPE ? chipCount : 1);
+    
+    //striped, an erase covers the same stretch of every chip
+    eraseOpCount = 0;
+    for(uint8_t i = 0; i < first->eraseOpCount && i < FLASH_MAX_ERASE_OPS; i++)
+    {
+        EraseOp op = first->eraseOps[i];
+        if(layout == FLASH_STRIPE)
+        {
+            op.size *= chipCount;
+            op.minAddress *= chipCount;
+        }
+        else if(op.minAddress) continue; //would have to hold at the bottom of every chip, not just the first
+        
+        arrayOps[eraseOpCount++] = op;
+    }
+    eraseOps = arrayOps;
+    
+    byteCount = chipBytes * chipCount;
+    
+    return idData;
+}
+
+uint32_t FlashArray::Locate(uint32_t address, uint32_t& count, uint8_t& chip)
+{
+    uint32_t chipAddress = 0;
+    uint32_t room = 0;
+    
+    if(layout == FLASH_STRIPE)
+    {
+        uint32_t page = address / bytesPerPage;
+        uint16_t offset = address % bytesPerPage;
+        
+        chip = page % chipCount;
+        chipAddress = page / chipCount * bytesPerPage + offset;
+        room = bytesPerPage - offset;
+    }
+    else
+    {
+        chip = address / chipBytes;
+        chipAddress = address % chipBytes;
+        room = chipBytes - chipAddress;
+    }
+    
+    if(count > room) count = room;
+    
+    return chipAddress;
+}
+
+void FlashArray::BeginChip(uint8_t chip)
+{
+    uint8_t bit = 1 << chip;
+    if(!(erasing & bit)) return;
+    
+    if(chips[chip]->IsBusy())
+    {
+        chips[chip]->SuspendErase();
+        chips[chip]->WaitWhileBusy(); //suspend takes effect in tens of us
+        
+        suspended |= bit;
+    }
+    else erasing &= ~bit; //it's finished: once we program, the chip is busy with something that can't be suspended
+}
+
+void FlashArray::EndChip(uint8_t chip)
+{
+    uint8_t bit = 1 << chip;
+    if(!(suspended & bit)) return;
+    
+    chips[chip]->WaitWhileBusy(); //anything programmed during the suspend has to finish first
+    chips[chip]->ResumeErase();
+    
+    suspended &= ~bit;
+}
+
+/*
+ * Poll() only gets here once every chip is idle, so none of them has an erase that's still going
+ */
+uint8_t FlashArray::SendErase(uint32_t address, uint8_t sizeCmd)
+{
+    if(address >= byteCount) return 0; //basic check for address range
+    
+    //StartErase() cleared the array's cache; the chips' own caches still hold what's being erased
+    uint32_t size = 0;
+    for(uint8_t i = 0; i < eraseOpCount && !size; i++)
+    {
+        if(eraseOps[i].cmd == sizeCmd) size = eraseOps[i].size;
+    }
+    
+    erasing = 0;
+    
+    if(layout == FLASH_STRIPE)
+    {
+        for(uint8_t i = 0; i < chipCount; i++)
+        {
+            chips[i]->InvalidateCache(address / chipCount, size / chipCount);
+            if(!chips[i]->SendErase(address / chipCount, sizeCmd)) return 0;
+            erasing |= 1 << i;
+        }
+        
+        return 1;
+    }
+    
+    uint8_t chip = address / chipBytes;
+    chips[chip]->InvalidateCache(address % chipBytes, size);
+    if(!chips[chip]->SendErase(address % chipBytes, sizeCmd)) return 0;
+    erasing = 1 << chip;
+    
+    return 1;
+}
+
+uint8_t FlashArray::IsBusy(void)
+{
+    for(uint8_t i = 0; i < chipCount; i++)
+    {
+        if(chips[i]->IsBusy()) return 1;
+    }
+    
+    return 0;
+}
+
+uint32_t FlashArray::Write(uint32_t address, const uint8_t* data, uint32_t count)
+{
+    if(address >= byteCount) return 0; //basic check for address range
+    
+    if(count > byteCount - address) count = byteCount - address;
+    if(IsQueuedForErase(address, count)) return 0;
+    
+    //each chip's driver combines its own pages, and returns while the program runs
+    uint32_t written = 0;
+    while(written < count)
+    {
+        uint8_t chip = 0;
+        uint32_t run = count - written;
+        uint32_t chipAddress = Locate(address + written, run, chip);
+        
+        BeginChip(chip);
+        uint32_t n = chips[chip]->Write(chipAddress, data + written, run);
+        EndChip(chip);
+        
+        written += n;
+        if(n != run) break;
+    }
+    
+    return written;
+}
+
+uint32_t FlashArray::Flush(void)
+{
+    uint32_t count = 0;
+    for(uint8_t i = 0; i < chipCount; i++)
+    {
+        BeginChip(i);
+        count += chips[i]->Flush();
+        EndChip(i);
+    }
+    
+    return count;
+}
+
+uint32_t FlashArray::Update(uint32_t address, const uint8_t* data, uint32_t count)
+{
+    if(address >= byteCount) return 0; //basic check for address range
+    
+    if(count > byteCount - address) count = byteCount - address;
+    if(IsQueuedForErase(address, count)) return 0;
+    
+    uint32_t written = 0;
+    while(written < count)
+    {
+        uint8_t chip = 0;
+        uint32_t run = count - written;
+        uint32_t chipAddress = Locate(address + written, run, chip);
+        
+        //programming with erase isn't allowed while an erase is suspended, so let this chip's finish
+        if(erasing & (1 << chip)) chips[chip]->WaitWhileBusy();
+        erasing &= ~(1 << chip);
+        
+        uint32_t n = chips[chip]->Update(chipAddress, data + written, run);
+        
+        written += n;
+        if(n != run) break;
+    }
+    
+    return written;
+}
+
+uint8_t FlashArray::BeginRead(uint32_t address, uint32_t count)
+{
+    if(address >= byteCount) return 0; //basic check for address range
+    if(IsQueuedForErase(address, count)) return 0;
+    
+    readAddress = address;
+    
+    return 1;
+}
+
+uint32_t FlashArray::ReadBytes(uint32_t address, uint8_t* data, uint32_t count)
+{
+    if(address >= byteCount) return 0; //basic check for address range
+    
+    if(count > byteCount - address) count = byteCount - address;
+    if(IsQueuedForErase(address, count)) return 0;
+    
+    uint32_t done = 0;
+    while(done < count)
+    {
+        uint8_t chip = 0;
+        uint32_t run = count - done;
+        uint32_t chipAddress = Locate(address + done, run, chip);
+        
+        BeginChip(chip);
+        uint32_t n = chips[chip]->ReadBytes(chipAddress, data + done, run);
+        EndChip(chip);
+        
+        done += n;
+        if(n != run) break;
+    }
+    
+    return done;
+}
+
+#if FLASH_INSTRUMENTATION
+void FlashArray::DumpStats(Print& out)
+{
+    for(uint8_t i = 0; i < chipCount; i++)
+    {
+        out.print(F("chip "));
+        out.println(i);
+        
+        chips[i]->DumpStats(out);
+    }
+}
+
+void FlashArray::ResetStats(void)
+{
+    for(uint8_t i = 0; i < chipCount; i++) chips[i]->ResetStats();
+}
+#endif
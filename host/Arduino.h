@@ -0,0 +1,118 @@
+//
+//  Arduino.h
+//  flash
+//
+//  Host-side stand-in for the bits of the Arduino core this library uses, so the
+//  drivers can be built and run on Linux against the chip models in FlashSim.h.
+//  Put this directory ahead of everything else on the include path.
+//
+
+#ifndef host_Arduino_h
+#define host_Arduino_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <string>
+
+#define HIGH    0x1
+#define LOW     0x0
+
+#define INPUT   0x0
+#define OUTPUT  0x1
+
+#define LSBFIRST 0
+#define MSBFIRST 1
+
+#define DEC 10
+#define HEX 16
+
+#define F(str) (str)
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+//time comes from the simulator clock, which only moves when the bus or a delay moves it
+unsigned long micros(void);
+unsigned long millis(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+inline void interrupts(void) {}
+inline void noInterrupts(void) {}
+
+class String
+{
+protected:
+    std::string str;
+
+public:
+    String(const char* s = "") : str(s ? s : "") {}
+    String(char c) : str(1, c) {}
+    String(int val, uint8_t base = DEC) { Format(val < 0 ? "-" : "", val < 0 ? -(long long)val : val, base); }
+    String(unsigned int val, uint8_t base = DEC) { Format("", val, base); }
+    String(long val, uint8_t base = DEC) { Format(val < 0 ? "-" : "", val < 0 ? -(long long)val : val, base); }
+    String(unsigned long val, uint8_t base = DEC) { Format("", val, base); }
+    
+    String operator + (const String& s) const { String r(*this); r.str += s.str; return r; }
+    String operator + (const char* s) const { return *this + String(s); }
+    String operator + (char c) const { return *this + String(c); }
+    String& operator += (const String& s) { str += s.str; return *this; }
+    
+    bool operator == (const String& s) const { return str == s.str; }
+    
+    unsigned int length(void) const { return str.size(); }
+    const char* c_str(void) const { return str.c_str(); }
+
+protected:
+    void Format(const char* sign, unsigned long long val, uint8_t base)
+    {
+        char buf[24];
+        snprintf(buf, sizeof(buf), base == HEX ? "%s%llX" : "%s%llu", sign, val);
+        str = buf;
+    }
+};
+
+class Print
+{
+public:
+    virtual ~Print(void) {}
+    virtual size_t write(uint8_t c) { return write(&c, 1); }
+    virtual size_t write(const uint8_t* buf, size_t count) = 0;
+    
+    size_t print(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+    size_t print(const String& s) { return print(s.c_str()); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int val, uint8_t base = DEC) { return print(String(val, base)); }
+    size_t print(unsigned int val, uint8_t base = DEC) { return print(String(val, base)); }
+    size_t print(long val, uint8_t base = DEC) { return print(String(val, base)); }
+    size_t print(unsigned long val, uint8_t base = DEC) { return print(String(val, base)); }
+    size_t print(double val, int digits = 2)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.*f", digits, val);
+        return print(buf);
+    }
+    
+    size_t println(void) { return print("\r\n"); }
+    template <class T> size_t println(const T& val) { return print(val) + println(); }
+    template <class T> size_t println(const T& val, int fmt) { return print(val, fmt) + println(); }
+};
+
+class HostSerial : public Print
+{
+public:
+    void begin(unsigned long) {}
+    operator bool(void) { return true; }
+    size_t write(const uint8_t* buf, size_t count) { return fwrite(buf, 1, count, stdout); }
+    using Print::write;
+};
+
+extern HostSerial Serial;
+extern HostSerial SerialUSB;
+
+#endif /* host_Arduino_h */
@@ -0,0 +1,28 @@
+//
+//  FlashBenchmark.cpp
+//  flash
+//
+//  Runs examples/FlashBenchmark against the simulated chips. Simulated time makes
+//  the numbers repeat exactly from run to run, so the output can be diffed against
+//  a saved copy to catch regressions:
+//
+//      g++ -std=c++11 -O2 -Ihost -I. -I<path to TList> host/FlashBenchmark.cpp host/FlashSim.cpp *.cpp -o bench
+//      ./bench > results.csv
+//
+
+#include <FlashSim.h>
+
+#define AT25_CS2 12
+
+#include "../examples/FlashBenchmark/FlashBenchmark.ino"
+
+int main(void)
+{
+    SimAT25DF641A at25Chip(AT25_CS);
+    SimAT25DF641A at25Chip2(AT25_CS2);
+    SimAT45DB321E at45Chip(AT45_CS);
+    
+    setup();
+    
+    return 0;
+}
@@ -0,0 +1,615 @@
+//
+//  FlashSim.cpp
+//  flash
+//
+//  Host-side Arduino pin/time functions, SPIClass, and the chip models.
+//
+
+#include "FlashSim.h"
+
+uint64_t SimClock::nanos = 0;
+uint32_t SimClock::callOverheadNs = 1000;
+
+#define SIM_MAX_CHIPS 8
+SimChip* SimChip::chips[SIM_MAX_CHIPS];
+uint8_t SimChip::chipCount = 0;
+
+HostSerial Serial;
+HostSerial SerialUSB;
+SPIClass SPI;
+
+static uint8_t pinState[256];
+
+/////////////////////////////////////////////////////////////////////////////
+//Arduino core
+
+void pinMode(uint8_t, uint8_t) {}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+    pinState[pin] = val;
+    
+    for(uint8_t i = 0; i < SimChip::chipCount; i++)
+    {
+        if(SimChip::chips[i]->GetPin() != pin) continue;
+        
+        if(val == LOW) SimChip::chips[i]->Select();
+        else SimChip::chips[i]->Deselect();
+    }
+}
+
+int digitalRead(uint8_t pin) { return pinState[pin]; }
+
+unsigned long micros(void) { return SimClock::Now() / 1000; }
+unsigned long millis(void) { return SimClock::Now() / 1000000; }
+void delay(unsigned long ms) { SimClock::Advance((uint64_t)ms * 1000000); }
+void delayMicroseconds(unsigned int us) { SimClock::Advance((uint64_t)us * 1000); }
+
+/////////////////////////////////////////////////////////////////////////////
+//SPIClass
+
+void SPIClass::Clock(size_t count)
+{
+    callCount++;
+    byteCount += count;
+    SimClock::Advance(SimClock::callOverheadNs + (uint64_t)count * 8000000000ull / clockHz);
+}
+
+uint8_t SPIClass::transfer(uint8_t data)
+{
+    Clock(1);
+    
+    uint8_t miso = 0xff; //pulled up when nobody drives it
+    for(uint8_t i = 0; i < SimChip::chipCount; i++)
+    {
+        if(SimChip::chips[i]->IsSelected()) miso &= SimChip::chips[i]->Wire(SimChip::chips[i]->Transfer(data), clockHz);
+    }
+    
+    return miso;
+}
+
+uint16_t SPIClass::transfer16(uint16_t data)
+{
+    uint16_t hi = transfer((uint8_t)(data >> 8));
+    return (hi << 8) | transfer((uint8_t)data);
+}
+
+void SPIClass::transfer(void* buf, size_t count)
+{
+    Clock(count);
+    
+    uint8_t* b = (uint8_t*)buf;
+    for(size_t j = 0; j < count; j++)
+    {
+        uint8_t miso = 0xff;
+        for(uint8_t i = 0; i < SimChip::chipCount; i++)
+        {
+            if(SimChip::chips[i]->IsSelected()) miso &= SimChip::chips[i]->Wire(SimChip::chips[i]->Transfer(b[j]), clockHz);
+        }
+        
+        b[j] = miso;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//SimChip
+
+SimChip::SimChip(uint8_t cs, uint32_t bytes) : csPin(cs), byteCount(bytes)
+{
+    memory = new uint8_t[byteCount];
+    memset(memory, 0xff, byteCount); //chips ship erased
+    
+    if(chipCount < SIM_MAX_CHIPS) chips[chipCount++] = this;
+}
+
+SimChip::~SimChip(void)
+{
+    for(uint8_t i = 0; i < chipCount; i++)
+    {
+        if(chips[i] != this) continue;
+        
+        chips[i] = chips[--chipCount];
+        break;
+    }
+    
+    delete [] memory;
+}
+
+void SimChip::Select(void)
+{
+    if(selected) return;
+    
+    Service();
+    
+    selected = true;
+    ignoring = false;
+    index = 0;
+    opcode = 0;
+    address = 0;
+}
+
+void SimChip::Deselect(void)
+{
+    if(!selected) return;
+    
+    selected = false;
+    if(index && !ignoring) Finish();
+}
+
+uint8_t SimChip::Transfer(uint8_t mosi)
+{
+    Service();
+    
+    uint8_t miso = Clock(mosi);
+    index++;
+    
+    return miso;
+}
+
+uint8_t SimChip::Wire(uint8_t miso, uint32_t hz)
+{
+    if(!maxClockHz || hz <= maxClockHz) return miso;
+    
+    //ringing past the limit: flip a bit in about one byte in eight (xorshift, so runs repeat)
+    static uint32_t noise = 2463534242u;
+    noise ^= noise << 13;
+    noise ^= noise >> 17;
+    noise ^= noise << 5;
+    
+    return (noise & 7) ? miso : miso ^ (1 << ((noise >> 3) & 7));
+}
+
+uint8_t SimChip::TransferDual(void)
+{
+    dualBus = true;
+    uint8_t miso = Transfer(0xff);
+    dualBus = false;
+    
+    return miso;
+}
+
+void SimDualReceive(uint8_t* data, uint32_t count)
+{
+    SimClock::Advance(SimClock::callOverheadNs + (uint64_t)count * 4000000000ull / SPI.GetClock());
+    
+    for(uint32_t j = 0; j < count; j++)
+    {
+        data[j] = 0xff;
+        for(uint8_t i = 0; i < SimChip::chipCount; i++)
+        {
+            if(SimChip::chips[i]->IsSelected()) data[j] &= SimChip::chips[i]->Wire(SimChip::chips[i]->TransferDual(), SPI.GetClock());
+        }
+    }
+}
+
+void SimChip::Service(void)
+{
+    if(erasing && !suspended && SimClock::Now() >= busyUntil)
+    {
+        memset(&memory[eraseAddress], 0xff, eraseSize);
+        erasing = false;
+    }
+}
+
+void SimChip::StartErase(uint32_t addr, uint32_t size, uint32_t us)
+{
+    eraseAddress = addr;
+    eraseSize = size;
+    erasing = true;
+    eraseCount++;
+    
+    StartBusy(us);
+}
+
+bool SimChip::Suspend(uint32_t latencyUs)
+{
+    if(!erasing || suspended) return false;
+    
+    eraseRemaining = busyUntil > SimClock::Now() ? busyUntil - SimClock::Now() : 0;
+    suspended = true;
+    StartBusy(latencyUs);
+    
+    return true;
+}
+
+bool SimChip::Resume(void)
+{
+    if(!suspended || SimClock::Now() < busyUntil) return false;
+    
+    suspended = false;
+    busyUntil = SimClock::Now() + eraseRemaining;
+    
+    return true;
+}
+
+bool SimChip::InEraseRegion(uint32_t addr, uint32_t size)
+{
+    if(!erasing) return false;
+    return addr < eraseAddress + eraseSize && eraseAddress < addr + size;
+}
+
+void SimChip::Program(uint32_t addr, const uint8_t* data, uint32_t count)
+{
+    for(uint32_t i = 0; i < count; i++)
+    {
+        uint8_t& cell = memory[(addr + i) & (byteCount - 1)];
+        if(data[i] != 0xff && (data[i] & ~cell)) overwriteCount++; //0xff is how you leave a byte alone
+        cell &= data[i];
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//SimAT25DF641A
+
+#define AT25_STATUS_BSY 0x01
+#define AT25_STATUS_WEL 0x02
+#define AT25_STATUS_ES  0x02 //in byte 2
+
+uint8_t SimAT25DF641A::Status1(void)
+{
+    return (SimClock::Now() < busyUntil ? AT25_STATUS_BSY : 0) | (wel ? AT25_STATUS_WEL : 0);
+}
+
+uint8_t SimAT25DF641A::Status2(void)
+{
+    return (SimClock::Now() < busyUntil ? AT25_STATUS_BSY : 0) | (suspended ? AT25_STATUS_ES : 0);
+}
+
+uint8_t SimAT25DF641A::Clock(uint8_t mosi)
+{
+    if(index == 0)
+    {
+        opcode = mosi;
+        
+        //while busy, only status and suspend/resume get through
+        if(SimClock::Now() < busyUntil && opcode != 0x05 && opcode != 0xB0 && opcode != 0xD0)
+        {
+            busyViolations++;
+            ignoring = true;
+        }
+        
+        if(opcode == 0x02) memset(latched, 0, sizeof(latched));
+        
+        return 0xff;
+    }
+    
+    if(ignoring) return 0xff;
+    
+    switch(opcode)
+    {
+        case 0x05: //status, bytes 1 and 2 repeat
+            return (index & 1) ? Status1() : Status2();
+        
+        case 0x9F: //JEDEC ID
+        {
+            static const uint8_t id[] = {0x1F, 0x48, 0x00, 0x00};
+            return index <= 4 ? id[index - 1] : 0x00;
+        }
+        
+        case 0x0B: //fast read, one dummy byte
+        case 0x03: //read
+        {
+            if(!ShiftAddress(mosi)) return 0xff;
+            if(opcode == 0x0B && index == 4) return 0xff;
+            
+            uint8_t b = memory[address];
+            address = (address + 1) & (byteCount - 1);
+            return b;
+        }
+        
+        case 0x3B: //dual-output read, one dummy byte, then data two bits per clock
+        {
+            if(!ShiftAddress(mosi)) return 0xff;
+            if(index == 4) return 0xff;
+            
+            uint8_t b = memory[address];
+            address = (address + 1) & (byteCount - 1);
+            if(dualBus) return b;
+            
+            //a one-line controller only sees SO, which has the odd bits: two bytes' worth per 8 clocks
+            uint8_t b2 = memory[address];
+            address = (address + 1) & (byteCount - 1);
+            
+            uint8_t odd = 0;
+            for(uint8_t k = 0; k < 4; k++)
+            {
+                odd |= ((b >> (7 - 2 * k)) & 1) << (7 - k);
+                odd |= ((b2 >> (7 - 2 * k)) & 1) << (3 - k);
+            }
+            
+            return odd;
+        }
+        
+        case 0x02: //page program: latch bytes, wrapping within the page
+        {
+            if(!ShiftAddress(mosi)) return 0xff;
+            
+            uint8_t offset = address;
+            pageLatch[offset] = mosi;
+            latched[offset] = true;
+            address = (address & ~0xfful) | (uint8_t)(offset + 1);
+            return 0xff;
+        }
+        
+        case 0x3C: //sector protection: the model is always unprotected
+            if(!ShiftAddress(mosi)) return 0xff;
+            return 0x00;
+        
+        default:
+            ShiftAddress(mosi);
+            return 0xff;
+    }
+}
+
+void SimAT25DF641A::Finish(void)
+{
+    switch(opcode)
+    {
+        case 0x06: wel = true; break;
+        case 0x04: wel = false; break;
+        
+        case 0x01: //write status (protection bits aren't modelled)
+            if(!wel) protocolErrors++;
+            wel = false;
+            break;
+        
+        case 0x02:
+        {
+            if(!wel || index < 4) { protocolErrors++; break; }
+            if(suspended && InEraseRegion(address & ~0xfful, 256)) { protocolErrors++; break; }
+            
+            uint32_t page = address & ~0xfful;
+            for(uint16_t i = 0; i < 256; i++)
+            {
+                if(latched[i]) Program(page + i, &pageLatch[i], 1);
+            }
+            programCount++;
+            
+            wel = false;
+            StartBusy(pageProgramUs);
+            break;
+        }
+        
+        case 0x20:
+        case 0x52:
+        case 0xD8:
+        {
+            if(!wel || index < 4 || suspended) { protocolErrors++; break; }
+            
+            uint32_t size = opcode == 0x20 ? 4096 : (opcode == 0x52 ? 32768 : 65536);
+            uint32_t us = opcode == 0x20 ? erase4KUs : (opcode == 0x52 ? erase32KUs : erase64KUs);
+            StartErase(address & ~(size - 1), size, us);
+            
+            wel = false;
+            break;
+        }
+        
+        case 0x60:
+        case 0xC7:
+            if(!wel || suspended) { protocolErrors++; break; }
+            StartErase(0, byteCount, chipEraseUs);
+            wel = false;
+            break;
+        
+        case 0xB0:
+            if(!Suspend(suspendUs)) protocolErrors++;
+            break;
+        
+        case 0xD0:
+            if(!Resume()) protocolErrors++;
+            break;
+        
+        default:
+            break;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//SimAT45DB321E, binary (512-byte) page mode
+
+#define AT45_STATUS_RDY     0x80
+#define AT45_STATUS_DENSITY 0x34 //1101 in bits 5-2 for 32Mbit
+#define AT45_STATUS_BINARY  0x01
+#define AT45_STATUS_ES      0x01 //in byte 2
+
+uint8_t SimAT45DB321E::Status1(void)
+{
+    return (SimClock::Now() < busyUntil ? 0 : AT45_STATUS_RDY) | AT45_STATUS_DENSITY | AT45_STATUS_BINARY;
+}
+
+uint8_t SimAT45DB321E::Status2(void)
+{
+    return (SimClock::Now() < busyUntil ? 0 : AT45_STATUS_RDY) | (suspended ? AT45_STATUS_ES : 0);
+}
+
+void SimAT45DB321E::Service(void)
+{
+    SimChip::Service();
+    if(SimClock::Now() >= busyUntil) busyBuffer = 0;
+}
+
+uint8_t SimAT45DB321E::Clock(uint8_t mosi)
+{
+    if(index == 0)
+    {
+        opcode = mosi;
+        
+        if(SimClock::Now() < busyUntil)
+        {
+            //status, suspend/resume and the SRAM buffer that isn't being programmed are still available
+            uint8_t buf = 0;
+            if(opcode == 0x84 || opcode == 0xD4 || opcode == 0xD1) buf = 1;
+            if(opcode == 0x87 || opcode == 0xD6 || opcode == 0xD3) buf = 2;
+            
+            bool allowed = opcode == 0xD7 || opcode == 0xB0 || opcode == 0xD0 || (buf && buf != busyBuffer);
+            if(!allowed)
+            {
+                busyViolations++;
+                ignoring = true;
+            }
+        }
+        
+        if(opcode == 0x02) memset(touched, 0, sizeof(touched));
+        
+        return 0xff;
+    }
+    
+    if(ignoring) return 0xff;
+    
+    switch(opcode)
+    {
+        case 0xD7: //status, bytes 1 and 2 repeat
+            return (index & 1) ? Status1() : Status2();
+        
+        case 0x9F: //JEDEC ID
+        {
+            static const uint8_t id[] = {0x1F, 0x27, 0x01, 0x01, 0x00};
+            return index <= 5 ? id[index - 1] : 0x00;
+        }
+        
+        case 0x0B: //continuous array read, one dummy byte
+        case 0x03:
+        {
+            if(!ShiftAddress(mosi)) return 0xff;
+            if(opcode == 0x0B && index == 4) return 0xff;
+            
+            uint8_t b = memory[address];
+            address = (address + 1) & (byteCount - 1);
+            return b;
+        }
+        
+        case 0xD4: //buffer reads; D4h/D6h take a dummy byte
+        case 0xD6:
+        case 0xD1:
+        case 0xD3:
+        {
+            if(!ShiftAddress(mosi)) return 0xff;
+            if((opcode == 0xD4 || opcode == 0xD6) && index == 4) return 0xff;
+            
+            uint8_t* buf = buffer[(opcode == 0xD4 || opcode == 0xD1) ? 0 : 1];
+            uint8_t b = buf[address & 0x1ff];
+            address++;
+            return b;
+        }
+        
+        case 0x84: //buffer writes
+        case 0x87:
+        case 0x82: //program through buffer with erase
+        case 0x85:
+        case 0x02: //program through buffer 1 without erase
+        {
+            if(!ShiftAddress(mosi)) return 0xff;
+            
+            uint8_t* buf = buffer[(opcode == 0x87 || opcode == 0x85) ? 1 : 0];
+            uint16_t offset = (address + (index - 4)) & 0x1ff;
+            buf[offset] = mosi;
+            if(opcode == 0x02) touched[offset] = true;
+            return 0xff;
+        }
+        
+        case 0xC7: //chip erase is C7h 94h 80h 9Ah
+        {
+            static const uint8_t seq[] = {0x94, 0x80, 0x9A};
+            if(index <= 3 && mosi != seq[index - 1]) ignoring = true;
+            return 0xff;
+        }
+        
+        default:
+            ShiftAddress(mosi);
+            return 0xff;
+    }
+}
+
+void SimAT45DB321E::BufferToPage(uint8_t buf, bool erase, uint32_t us)
+{
+    uint32_t page = address & ~0x1fful;
+    
+    if(suspended && InEraseRegion(page, 512)) { protocolErrors++; return; }
+    
+    if(erase) memcpy(&memory[page], buffer[buf - 1], 512);
+    else Program(page, buffer[buf - 1], 512);
+    programCount++;
+    
+    busyBuffer = buf;
+    StartBusy(us);
+}
+
+void SimAT45DB321E::Finish(void)
+{
+    bool hasAddress = index >= 4;
+    
+    switch(opcode)
+    {
+        case 0x83: if(hasAddress) BufferToPage(1, true, pageEraseProgramUs); break;
+        case 0x86: if(hasAddress) BufferToPage(2, true, pageEraseProgramUs); break;
+        case 0x88: if(hasAddress) BufferToPage(1, false, pageProgramUs); break;
+        case 0x89: if(hasAddress) BufferToPage(2, false, pageProgramUs); break;
+        case 0x82: if(hasAddress) BufferToPage(1, true, pageEraseProgramUs); break;
+        case 0x85: if(hasAddress) BufferToPage(2, true, pageEraseProgramUs); break;
+        
+        case 0x02:
+        {
+            if(!hasAddress) break;
+            
+            uint32_t page = address & ~0x1fful;
+            if(suspended && InEraseRegion(page, 512)) { protocolErrors++; break; }
+            
+            for(uint16_t i = 0; i < 512; i++)
+            {
+                if(touched[i]) Program(page + i, &buffer[0][i], 1);
+            }
+            programCount++;
+            
+            busyBuffer = 1;
+            StartBusy(pageProgramUs);
+            break;
+        }
+        
+        case 0x53: //main memory page to buffer
+        case 0x55:
+            if(!hasAddress) break;
+            memcpy(buffer[opcode == 0x53 ? 0 : 1], &memory[address & ~0x1fful], 512);
+            busyBuffer = opcode == 0x53 ? 1 : 2;
+            StartBusy(transferUs);
+            break;
+        
+        case 0x81: //page erase
+            if(!hasAddress || suspended) break;
+            StartErase(address & ~0x1fful, 512, pageEraseUs);
+            break;
+        
+        case 0x50: //block erase, 8 pages
+            if(!hasAddress || suspended) break;
+            StartErase(address & ~0xffful, 4096, blockEraseUs);
+            break;
+        
+        case 0x7C: //sector erase: sector 0 is split into 0a (one block) and 0b (the rest)
+        {
+            if(!hasAddress || suspended) break;
+            
+            uint32_t start = address & ~0xfffful;
+            uint32_t size = 65536;
+            if(address < 4096) size = 4096;
+            else if(address < 65536) { start = 4096; size = 65536 - 4096; }
+            
+            StartErase(start, size, sectorEraseUs);
+            break;
+        }
+        
+        case 0xC7:
+            if(index == 4 && !suspended) StartErase(0, byteCount, chipEraseUs);
+            else protocolErrors++;
+            break;
+        
+        case 0xB0:
+            if(!Suspend(suspendUs)) protocolErrors++;
+            break;
+        
+        case 0xD0:
+            if(!Resume()) protocolErrors++;
+            break;
+        
+        default:
+            break;
+    }
+}
@@ -0,0 +1,180 @@
+//
+//  FlashSim.h
+//  flash
+//
+//  Host-side models of the AT25DF641A and AT45DB321E, so the drivers and the
+//  FlashStoreManager can be run (and timed) without hardware.
+//
+//  Each chip sits on a chip select pin: digitalWrite() on that pin selects it and
+//  SPIClass::transfer() clocks bytes into it. Memory follows NOR rules (programming
+//  only clears bits, erasing sets them), and program/erase operations hold the chip
+//  busy for their typical datasheet time on a simulated clock. The clock only moves
+//  when the bus (or delay()) moves it, so busy-polling loops finish in a sensible
+//  number of iterations and micros() gives reproducible timings.
+//
+
+#ifndef FlashSim_h
+#define FlashSim_h
+
+#include <Arduino.h>
+#include <SPI.h>
+
+class SimClock
+{
+protected:
+    static uint64_t nanos;
+
+public:
+    static uint64_t Now(void) { return nanos; }
+    static void Advance(uint64_t ns) { nanos += ns; }
+    static void Reset(void) { nanos = 0; }
+    
+    //cost of a call into the SPI layer on top of the bits on the wire
+    //(function call, waiting on the data register, bus turnaround)
+    static uint32_t callOverheadNs;
+};
+
+class SimChip
+{
+protected:
+    uint8_t csPin;
+    uint32_t byteCount;
+    uint8_t* memory = NULL;
+    
+    bool selected = false;
+    bool dualBus = false; //bytes are being clocked by SimDualReceive(), two bits per clock
+    bool ignoring = false; //command arrived while busy or without the right preconditions
+    uint32_t index = 0; //bytes clocked since chip select went low
+    uint8_t opcode = 0;
+    uint32_t address = 0;
+    
+    uint64_t busyUntil = 0;
+    
+    //erases are applied when their busy time runs out, so suspend/resume behaves
+    bool erasing = false;
+    bool suspended = false;
+    uint32_t eraseAddress = 0;
+    uint32_t eraseSize = 0;
+    uint64_t eraseRemaining = 0;
+    
+    //shift in the three address bytes; returns true once they're all in
+    bool ShiftAddress(uint8_t mosi)
+    {
+        if(index > 3) return true;
+        address = (address << 8) | mosi;
+        if(index == 3) address &= byteCount - 1;
+        return false;
+    }
+    
+    void StartBusy(uint32_t us) { busyUntil = SimClock::Now() + (uint64_t)us * 1000; }
+    void StartErase(uint32_t addr, uint32_t size, uint32_t us);
+    bool Suspend(uint32_t latencyUs);
+    bool Resume(void);
+    bool InEraseRegion(uint32_t addr, uint32_t size);
+    
+    void Program(uint32_t addr, const uint8_t* data, uint32_t count); //NOR: AND into memory
+    
+    virtual void Service(void); //retire operations whose time has run out
+    virtual uint8_t Clock(uint8_t mosi) = 0; //one byte while selected
+    virtual void Finish(void) = 0; //chip select went high
+
+public:
+    SimChip(uint8_t cs, uint32_t bytes);
+    virtual ~SimChip(void);
+    
+    void Select(void);
+    void Deselect(void);
+    uint8_t Transfer(uint8_t mosi);
+    uint8_t TransferDual(void); //one byte in on SO and SIO together
+    
+    bool IsBusy(void) { Service(); return SimClock::Now() < busyUntil; }
+    bool IsSelected(void) { return selected; }
+    uint8_t GetPin(void) { return csPin; }
+    
+    //fastest clock the wiring to this chip carries cleanly; above it, some bytes read back wrong (0: no limit)
+    uint32_t maxClockHz = 0;
+    uint8_t Wire(uint8_t miso, uint32_t hz);
+    
+    uint8_t* GetMemory(void) { return memory; }
+    uint32_t GetSize(void) { return byteCount; }
+    void EraseAll(void) { memset(memory, 0xff, byteCount); }
+    
+    //counters for regression and perf checks
+    uint32_t programCount = 0;
+    uint32_t eraseCount = 0;
+    uint32_t overwriteCount = 0;    //bytes (other than 0xff) where a program tried to set a cleared bit
+    uint32_t busyViolations = 0;    //commands the chip ignored because it was busy
+    uint32_t protocolErrors = 0;    //malformed or disallowed commands
+    
+    void ResetCounts(void) { programCount = eraseCount = overwriteCount = busyViolations = protocolErrors = 0; }
+    
+    //all chips on the bus, for routing chip selects and transfers
+    static SimChip* chips[];
+    static uint8_t chipCount;
+};
+
+/*
+ * Stand-in for a controller that can sample two data lines: pass it to
+ * FlashAT25DF641A::SetReadMode(). It takes half the wire time of SPI.transfer()
+ * at the same clock.
+ */
+void SimDualReceive(uint8_t* data, uint32_t count);
+
+class SimAT25DF641A : public SimChip
+{
+protected:
+    bool wel = false;
+    uint8_t pageLatch[256];
+    bool latched[256];
+    
+    uint8_t Clock(uint8_t mosi);
+    void Finish(void);
+    
+    uint8_t Status1(void);
+    uint8_t Status2(void);
+
+public:
+    SimAT25DF641A(uint8_t cs) : SimChip(cs, 8ul << 20) {}
+    
+    //typical datasheet timings, in us
+    uint32_t pageProgramUs = 1000;
+    uint32_t erase4KUs = 50000;
+    uint32_t erase32KUs = 250000;
+    uint32_t erase64KUs = 400000;
+    uint32_t chipEraseUs = 32000000;
+    uint32_t suspendUs = 30;
+};
+
+class SimAT45DB321E : public SimChip
+{
+protected:
+    uint8_t buffer[2][512];
+    uint8_t busyBuffer = 0; //SRAM buffer being programmed, if any
+    bool touched[512]; //bytes clocked in by 02h
+    
+    uint8_t Clock(uint8_t mosi);
+    void Finish(void);
+    void Service(void);
+    
+    uint8_t Status1(void);
+    uint8_t Status2(void);
+    
+    void BufferToPage(uint8_t buf, bool erase, uint32_t us);
+
+public:
+    SimAT45DB321E(uint8_t cs) : SimChip(cs, 4ul << 20) { memset(buffer, 0xff, sizeof(buffer)); }
+    
+    //typical datasheet timings, in us
+    uint32_t pageProgramUs = 2000;
+    uint32_t pageEraseProgramUs = 12000;
+    uint32_t pageEraseUs = 8000;
+    uint32_t blockEraseUs = 45000;
+    uint32_t sectorEraseUs = 700000;
+    uint32_t chipEraseUs = 40000000;
+    uint32_t transferUs = 200;
+    uint32_t suspendUs = 30;
+    
+    uint8_t* GetBuffer(uint8_t buf) { return buffer[(buf - 1) & 1]; }
+};
+
+#endif /* FlashSim_h */
@@ -0,0 +1,196 @@
+//
+//  FragmentationTest.cpp
+//  flash
+//
+//  Random CreateStore/DeleteStore cycles against the simulated chips, for each placement
+//  policy. Prints one CSV line per chip and policy (creates, failures, and how fragmented the
+//  free space got) and checks as it goes that every live store keeps its size and contents,
+//  across remounts too, and that the free space adds up. Exits non-zero if a check fails.
+//  The sequence is seeded, so the output repeats exactly:
+//
+//      g++ -std=c++11 -O2 -Ihost -I. -I<path to TList> host/FragmentationTest.cpp host/FlashSim.cpp *.cpp -o fragtest
+//      ./fragtest
+//
+
+#include <FlashSim.h>
+#include <dataflash.h>
+
+#define FRAG_CYCLES 4000
+#define FRAG_STORES 48 //store numbers in play; about half are live at once
+#define FRAG_REMOUNT 500 //cycles between remounts
+
+struct ShadowStore
+{
+    bool live = false;
+    uint32_t size = 0;
+    uint8_t tag[16]; //written as the store's first record
+};
+
+static uint32_t seed = 1;
+
+static uint32_t Random(void) //xorshift32, so the run is the same everywhere
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    
+    return seed;
+}
+
+static const char* policyNames[] = {"next_fit", "best_fit", "least_worn"};
+
+template <class FlashType>
+static uint32_t Check(FlashStoreManagerT<FlashType>& manager, ShadowStore* shadow, uint32_t usable)
+{
+    uint32_t errors = 0;
+    uint32_t allocated = 0;
+    
+    for(uint16_t i = 0; i < FRAG_STORES; i++)
+    {
+        DatastoreReaderT<FlashType> reader(&manager);
+        bool open = reader.Open(i);
+        
+        if(open != shadow[i].live)
+        {
+            printf("store %u: %s\n", i, open ? "still there after delete" : "missing");
+            errors++;
+            continue;
+        }
+        if(!open) continue;
+        
+        allocated += shadow[i].size;
+        
+        uint8_t tag[sizeof(shadow[i].tag)];
+        if(reader.Size() != sizeof(tag) || reader.Read(tag, sizeof(tag)) != sizeof(tag) || memcmp(tag, shadow[i].tag, sizeof(tag)))
+        {
+            printf("store %u: contents don't match\n", i);
+            errors++;
+        }
+    }
+    
+    uint32_t free = manager.GetFreeSpace();
+    if(free != usable - allocated)
+    {
+        printf("free space %u, expected %u\n", free, usable - allocated);
+        errors++;
+    }
+    
+    return errors;
+}
+
+template <class FlashType>
+static uint32_t Run(const char* chip, FlashType& flash, SimChip& sim, uint8_t policy)
+{
+    sim.EraseAll();
+    seed = 1;
+    
+    FlashStoreManagerT<FlashType> manager(&flash);
+    manager.Init();
+    manager.SetAllocPolicy(policy);
+    
+    uint32_t block = flash.GetBlockSize();
+    uint32_t usable = manager.GetFreeSpace();
+    uint32_t maxBlocks = flash.GetByteCount() / block / 16; //about three quarters full with half the numbers live
+    
+    ShadowStore shadow[FRAG_STORES];
+    
+    uint32_t creates = 0;
+    uint32_t failed = 0;
+    uint32_t fragmented = 0; //failed with enough space free, just not in one piece
+    uint32_t errors = 0;
+    
+    float fragSum = 0;
+    float fragMax = 0;
+    uint32_t extentSum = 0;
+    uint16_t extentMax = 0;
+    
+    for(uint32_t cycle = 1; cycle <= FRAG_CYCLES; cycle++)
+    {
+        uint16_t number = Random() % FRAG_STORES;
+        ShadowStore& store = shadow[number];
+        
+        if(store.live)
+        {
+            if(!manager.DeleteStore(number))
+            {
+                printf("store %u: delete failed\n", number);
+                errors++;
+            }
+            store.live = false;
+        }
+        else
+        {
+            uint32_t size = (1 + Random() % maxBlocks) * block;
+            uint32_t free = manager.GetFreeSpace();
+            
+            creates++;
+            if(manager.CreateStore(number, size))
+            {
+                while(manager.Poll()) delay(1); //as a main loop would
+                
+                for(uint8_t i = 0; i < sizeof(store.tag); i++) store.tag[i] = Random();
+                store.tag[sizeof(store.tag) - 1] = number; //mount takes trailing 0xff bytes for erased flash
+                if(manager.Write(store.tag, sizeof(store.tag)) != sizeof(store.tag))
+                {
+                    printf("store %u: write failed\n", number);
+                    errors++;
+                }
+                
+                store.live = true;
+                store.size = size;
+            }
+            else
+            {
+                failed++;
+                if(free >= size) fragmented++;
+            }
+        }
+        
+        uint32_t largest = 0;
+        uint16_t extents = 0;
+        uint32_t free = manager.GetFreeSpace(&largest, &extents);
+        
+        float frag = free ? 1 - (float)largest / free : 0;
+        fragSum += frag;
+        if(frag > fragMax) fragMax = frag;
+        extentSum += extents;
+        if(extents > extentMax) extentMax = extents;
+        
+        if(cycle % FRAG_REMOUNT == 0)
+        {
+            while(manager.Poll()) delay(1);
+            manager.Flush();
+            
+            manager.Init();
+            errors += Check(manager, shadow, usable);
+        }
+    }
+    
+    printf("%s,%s,%u,%u,%u,%u,%.1f,%u,%.3f,%.3f,%u\n", chip, policyNames[policy], FRAG_CYCLES, creates, failed, fragmented,
+           (float)extentSum / FRAG_CYCLES, extentMax, fragSum / FRAG_CYCLES, fragMax, errors);
+    
+    return errors;
+}
+
+int main(void)
+{
+    SimAT25DF641A at25Chip(10);
+    SimAT45DB321E at45Chip(11);
+    
+    FlashAT25DF641A at25(&SPI, 10);
+    FlashAT45DB321E at45(&SPI, 11);
+    at25.Init();
+    at45.Init();
+    
+    printf("chip,policy,cycles,creates,failed,failed_fragmented,extents_mean,extents_max,frag_mean,frag_max,errors\n");
+    
+    uint8_t policies = FLASH_WEAR_LEVELING ? 3 : 2;
+    uint32_t errors = 0;
+    for(uint8_t policy = 0; policy < policies; policy++)
+    {
+        errors += Run("AT25DF641A", at25, at25Chip, policy);
+        errors += Run("AT45DB321E", at45, at45Chip, policy);
+    }
+    
+    return errors ? 1 : 0;
+}
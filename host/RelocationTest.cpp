@@ -0,0 +1,193 @@
+//
+//  RelocationTest.cpp
+//  flash
+//
+//  Wraps a ring store until wear leveling starts moving it, then creates a store while the copy
+//  is still running in the background. The new store must not be given the ring's new home:
+//  once the move has finished, the test checks that the two don't overlap and reads both back,
+//  before and after a remount. Runs on each chip. Needs wear leveling, and a small margin so
+//  the move comes round in a few laps rather than a thousand. Exits non-zero if a check fails:
+//
+//      g++ -std=c++11 -O2 -DFLASH_WEAR_LEVELING=1 -DFLASH_WEAR_MARGIN=4 -Ihost -I. -I<path to TList> host/RelocationTest.cpp host/FlashSim.cpp *.cpp -o relocationtest
+//      ./relocationtest
+//
+
+#include <FlashSim.h>
+#include <dataflash.h>
+
+#if !FLASH_WEAR_LEVELING || FLASH_WEAR_MARGIN > 16
+#error "build with -DFLASH_WEAR_LEVELING=1 -DFLASH_WEAR_MARGIN=4"
+#endif
+
+#define RING_NUMBER 30
+#define STORE_NUMBER 5
+#define RING_RECORDS 200000 //gives up if the ring hasn't moved by then
+
+//lets the test see where the stores are and whether a move is under way
+template <class FlashType>
+class ManagerProbe : public FlashStoreManagerT<FlashType>
+{
+public:
+    ManagerProbe(FlashType* fl) : FlashStoreManagerT<FlashType>(fl) {}
+    
+    bool IsRelocating(void) {return this->relocating != 0xffff;}
+    
+    //where a store starts, from its description: "number\tsizekB \tstart"
+    uint32_t StartOf(uint16_t number)
+    {
+        Datastore* store = this->FindStore(number);
+        unsigned int n = 0, kB = 0, start = 0;
+        if(!store || sscanf(store->Display().c_str(), "%u\t%ukB \t%u", &n, &kB, &start) != 3) return 0;
+        
+        return start;
+    }
+};
+
+template <class FlashType>
+static uint32_t Check(const char* name, ManagerProbe<FlashType>& manager, uint32_t size, uint32_t storeSize, uint32_t free,
+                      uint32_t records, const uint8_t* tag, uint16_t tagSize)
+{
+    uint32_t errors = 0;
+    
+    uint32_t ringStart = manager.StartOf(RING_NUMBER);
+    uint32_t storeStart = manager.StartOf(STORE_NUMBER);
+    if(!ringStart || !storeStart || (ringStart < storeStart + storeSize && storeStart < ringStart + size))
+    {
+        printf("%s: ring at %u, store at %u\n", name, ringStart, storeStart);
+        errors++;
+    }
+    if(manager.GetFreeSpace() != free - size - storeSize)
+    {
+        printf("%s: free space %u, expected %u\n", name, manager.GetFreeSpace(), free - size - storeSize);
+        errors++;
+    }
+    
+    //the ring holds its newest records, in order, ending with the last one written
+    DatastoreReaderT<FlashType> ring(&manager);
+    uint32_t value = 0;
+    uint32_t expect = 0;
+    bool first = true;
+    ring.Open(RING_NUMBER);
+    while(ring.Read((uint8_t*)&value, sizeof(value)) == sizeof(value))
+    {
+        if(!first && value != expect)
+        {
+            printf("%s: ring record %u, expected %u\n", name, value, expect);
+            errors++;
+            break;
+        }
+        
+        expect = value + 1;
+        first = false;
+    }
+    if(expect != records)
+    {
+        printf("%s: ring ends at %u, expected %u\n", name, expect, records);
+        errors++;
+    }
+    
+    DatastoreReaderT<FlashType> store(&manager);
+    uint8_t data[64];
+    if(!store.Open(STORE_NUMBER) || store.Read(data, tagSize) != tagSize || memcmp(data, tag, tagSize))
+    {
+        printf("%s: store %u doesn't match\n", name, STORE_NUMBER);
+        errors++;
+    }
+    
+    return errors;
+}
+
+template <class FlashType>
+static uint32_t Run(const char* name, FlashType* flash, SimChip& sim)
+{
+    sim.EraseAll();
+    
+    ManagerProbe<FlashType> manager(flash);
+    manager.Init();
+    manager.SetAllocPolicy(ALLOC_LEAST_WORN); //new stores head for the same fresh blocks as the ring
+    
+    uint32_t size = 3 * flash->GetBlockSize();
+    uint32_t free = manager.GetFreeSpace();
+    manager.CreateStore(RING_NUMBER, size, true);
+    while(manager.Poll()) delay(1);
+    
+    uint8_t tag[64];
+    for(uint8_t i = 0; i < sizeof(tag); i++) tag[i] = i + 1;
+    
+    uint32_t errors = 0;
+    uint32_t records = 0;
+    uint32_t storeSize = 0;
+    bool created = false;
+    bool tagged = false;
+    
+    //write until the ring has moved, creating the store part way through the copy
+    uint32_t ringStart = manager.StartOf(RING_NUMBER);
+    while(records < RING_RECORDS && (manager.StartOf(RING_NUMBER) == ringStart || !tagged))
+    {
+        manager.Select(RING_NUMBER);
+        if(manager.Write((uint8_t*)&records, sizeof(records)) == sizeof(records)) records++;
+        manager.Poll();
+        
+        if(!created && manager.IsRelocating())
+        {
+            manager.GetFreeSpace(&storeSize); //all of the largest free extent, so it would have to take the ring's new home
+            created = manager.CreateStore(STORE_NUMBER, storeSize);
+            if(!created)
+            {
+                printf("%s: create during the move failed\n", name);
+                return errors + 1;
+            }
+        }
+        
+        //once its erase is done, between the ring's writes
+        if(created && !tagged)
+        {
+            manager.Select(STORE_NUMBER);
+            tagged = manager.Write(tag, sizeof(tag)) == sizeof(tag);
+        }
+        
+        delay(1);
+    }
+    
+    if(!tagged || manager.StartOf(RING_NUMBER) == ringStart)
+    {
+        printf("%s: the ring never moved\n", name);
+        return errors + 1;
+    }
+    
+    manager.Flush();
+    while(manager.Poll()) delay(1);
+    errors += Check(name, manager, size, storeSize, free, records, tag, sizeof(tag));
+    
+    ManagerProbe<FlashType> remounted(flash);
+    remounted.Init();
+    errors += Check(name, remounted, size, storeSize, free, records, tag, sizeof(tag));
+    
+    if(sim.protocolErrors || sim.busyViolations)
+    {
+        printf("%s: %u protocol errors, %u busy violations\n", name, sim.protocolErrors, sim.busyViolations);
+        errors++;
+    }
+    
+    printf("%s: %u records, ring moved %u -> %u, store at %u, %u errors\n", name, records, ringStart,
+           manager.StartOf(RING_NUMBER), manager.StartOf(STORE_NUMBER), errors);
+    
+    return errors;
+}
+
+int main(void)
+{
+    SimAT25DF641A at25Chip(10);
+    SimAT45DB321E at45Chip(11);
+    
+    FlashAT25DF641A at25(&SPI, 10);
+    FlashAT45DB321E at45(&SPI, 11);
+    at25.Init();
+    at45.Init();
+    
+    uint32_t errors = 0;
+    errors += Run("AT25DF641A", &at25, at25Chip);
+    errors += Run("AT45DB321E", &at45, at45Chip);
+    
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,81 @@
+//
+//  SPI.h
+//  flash
+//
+//  Host-side stand-in for SPIClass. Bytes are routed to whichever simulated chip
+//  (see FlashSim.h) has its chip select held low, and every call advances the
+//  simulator clock by the time the transfer would take on the wire.
+//
+
+#ifndef host_SPI_h
+#define host_SPI_h
+
+#include <Arduino.h>
+
+#define SPI_MODE0 0x00
+#define SPI_MODE1 0x04
+#define SPI_MODE2 0x08
+#define SPI_MODE3 0x0C
+
+//dividers are taken literally against SIM_F_CPU, as on the SAMD core
+#define SPI_CLOCK_DIV2      2
+#define SPI_CLOCK_DIV4      4
+#define SPI_CLOCK_DIV8      8
+#define SPI_CLOCK_DIV16     16
+#define SPI_CLOCK_DIV32     32
+#define SPI_CLOCK_DIV64     64
+#define SPI_CLOCK_DIV128    128
+
+#ifndef SIM_F_CPU
+#define SIM_F_CPU 48000000ul //what our SAMD21 loggers run at
+#endif
+
+class SPISettings
+{
+public:
+    uint32_t clock = 4000000;
+    uint8_t bitOrder = MSBFIRST;
+    uint8_t dataMode = SPI_MODE0;
+    
+    SPISettings(void) {}
+    SPISettings(uint32_t clk, uint8_t order, uint8_t mode) : clock(clk), bitOrder(order), dataMode(mode) {}
+};
+
+class SPIClass
+{
+protected:
+    uint32_t clockHz = SIM_F_CPU / SPI_CLOCK_DIV4;
+    uint8_t dataMode = SPI_MODE0;
+    
+    //bookkeeping so tests can see how the driver uses the bus
+    uint32_t callCount = 0;
+    uint32_t byteCount = 0;
+    
+    void Clock(size_t count);
+
+public:
+    SPIClass(void) {}
+    
+    void begin(void) {}
+    void end(void) {}
+    
+    void beginTransaction(SPISettings settings) { clockHz = settings.clock; dataMode = settings.dataMode; }
+    void endTransaction(void) {}
+    
+    void setClockDivider(uint32_t div) { clockHz = SIM_F_CPU / div; }
+    void setDataMode(uint8_t mode) { dataMode = mode; }
+    void setBitOrder(uint8_t) {}
+    
+    uint8_t transfer(uint8_t data);
+    uint16_t transfer16(uint16_t data);
+    void transfer(void* buf, size_t count);
+    
+    uint32_t GetClock(void) { return clockHz; }
+    uint32_t GetCallCount(void) { return callCount; }
+    uint32_t GetByteCount(void) { return byteCount; }
+    void ResetCounts(void) { callCount = byteCount = 0; }
+};
+
+extern SPIClass SPI;
+
+#endif /* host_SPI_h */
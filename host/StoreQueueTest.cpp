@@ -0,0 +1,161 @@
+//
+//  StoreQueueTest.cpp
+//  flash
+//
+//  A producer thread standing in for an interrupt handler Push()es numbered records into a
+//  StoreQueue as fast as it can, while the main thread Service()s the queue and Poll()s the
+//  manager, as loop() would. The store is then read back to check that every record arrived
+//  whole and in order, that the only gaps are the records Push() refused, and that those match
+//  the overflow count. Runs a plain store on each chip and a ring through the virtual Flash.
+//  Exits non-zero if a check fails:
+//
+//      g++ -std=c++11 -O2 -pthread -Ihost -I. -I<path to TList> host/StoreQueueTest.cpp host/FlashSim.cpp *.cpp -o queuetest
+//      ./queuetest
+//
+
+#include <FlashSim.h>
+#include <dataflash.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#define QUEUE_RECORDS 150000
+
+//10 bytes, so records straddle pages and the end of the queue's buffer
+struct Record
+{
+    uint32_t seq;
+    uint32_t check;
+    uint16_t pad;
+} __attribute__((packed));
+
+template <class FlashType>
+static uint32_t Run(const char* name, FlashType* flash, SimChip& sim, bool ring)
+{
+    sim.EraseAll();
+    
+    FlashStoreManagerT<FlashType> manager(flash);
+    manager.Init();
+    manager.CreateStore(5, ring ? 64 * 4096UL : 2 * 1024 * 1024UL, ring);
+    while(manager.Poll()) {}
+    manager.Select(5);
+    
+    StoreQueueT<FlashType> queue(&manager);
+    
+    std::vector<uint8_t> refused(QUEUE_RECORDS, 0);
+    std::atomic<bool> done(false);
+    
+    std::thread producer([&]
+    {
+        for(uint32_t i = 0; i < QUEUE_RECORDS; i++)
+        {
+            Record record = {i, ~i, (uint16_t)i};
+            if(!queue.Push(&record, sizeof(record))) refused[i] = 1;
+            if(i % 64 == 0) std::this_thread::yield(); //bursts, like interrupts
+        }
+        done = true;
+    });
+    
+    uint32_t written = 0;
+    while(!done)
+    {
+        written += queue.Service();
+        manager.Poll();
+    }
+    producer.join();
+    
+    written += queue.Service(true);
+    manager.Flush();
+    while(manager.Poll()) {}
+    
+    uint32_t errors = 0;
+    uint32_t dropped = 0;
+    for(uint32_t i = 0; i < QUEUE_RECORDS; i++) dropped += refused[i];
+    
+    if(dropped != queue.GetOverflows())
+    {
+        printf("%s: %u refused, but %u overflows counted\n", name, dropped, queue.GetOverflows());
+        errors++;
+    }
+    if(queue.GetQueued())
+    {
+        printf("%s: %u bytes left queued\n", name, queue.GetQueued());
+        errors++;
+    }
+    if(written != (QUEUE_RECORDS - dropped) * sizeof(Record))
+    {
+        printf("%s: %u bytes written, expected %u\n", name, written, (uint32_t)((QUEUE_RECORDS - dropped) * sizeof(Record)));
+        errors++;
+    }
+    
+    DatastoreReaderT<FlashType> reader(&manager);
+    reader.Open(5);
+    
+    //a ring has dropped its oldest block, which can leave part of a record at the front
+    if(ring)
+    {
+        uint8_t partial[sizeof(Record)];
+        reader.Read(partial, reader.Size() % sizeof(Record));
+    }
+    
+    uint32_t count = 0;
+    uint32_t expect = 0;
+    Record record;
+    while(reader.Read((uint8_t*)&record, sizeof(record)) == sizeof(record))
+    {
+        if(record.check != ~record.seq || record.pad != (uint16_t)record.seq)
+        {
+            printf("%s: record %u is corrupt\n", name, count);
+            errors++;
+        }
+        
+        //the next one pushed, skipping any that were refused (a ring starts wherever its oldest is)
+        if(ring && !count) expect = record.seq;
+        while(expect < QUEUE_RECORDS && refused[expect]) expect++;
+        if(record.seq != expect)
+        {
+            printf("%s: record %u is number %u, expected %u\n", name, count, record.seq, expect);
+            errors++;
+        }
+        
+        expect = record.seq + 1;
+        count++;
+    }
+    
+    if(!ring && count != QUEUE_RECORDS - dropped)
+    {
+        printf("%s: read %u records, expected %u\n", name, count, QUEUE_RECORDS - dropped);
+        errors++;
+    }
+    if(sim.protocolErrors || sim.busyViolations)
+    {
+        printf("%s: %u protocol errors, %u busy violations\n", name, sim.protocolErrors, sim.busyViolations);
+        errors++;
+    }
+    
+    printf("%s,%s,%u,%u,%u,%u,%u\n", name, ring ? "ring" : "plain", QUEUE_RECORDS, dropped, count,
+           queue.GetHighWater(), errors);
+    
+    return errors;
+}
+
+int main(void)
+{
+    SimAT25DF641A at25Chip(10);
+    SimAT45DB321E at45Chip(11);
+    
+    FlashAT25DF641A at25(&SPI, 10);
+    FlashAT45DB321E at45(&SPI, 11);
+    at25.Init();
+    at45.Init();
+    
+    printf("chip,store,pushed,dropped,read,high_water,errors\n");
+    
+    uint32_t errors = 0;
+    errors += Run("AT25DF641A", &at25, at25Chip, false);
+    errors += Run("AT45DB321E", &at45, at45Chip, false);
+    errors += Run<Flash>("AT45DB321E", &at45, at45Chip, true);
+    
+    return errors ? 1 : 0;
+}